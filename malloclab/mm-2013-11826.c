@@ -26,6 +26,34 @@
  * 20 pointers (WSIZE) point to the head of their list.
  * Each list is sorted by size, Allocator uses best-fit.
  *
+ * - Soft limit
+ * mm_set_soft_limit sets a soft limit on the heap size. Before extend_heap grows the heap past it,
+ * registered reclaim callbacks are asked to free memory (e.g. evict cached objects).
+ * If the freed blocks fit the request, the heap is not extended. Otherwise the heap grows anyway.
+ *
+ * - Small blocks
+ * Requests up to SMALL_MAX bytes are packed without header / footer into small pages.
+ * A small page is a SPAGE_SIZE-aligned (from the heap bottom) payload of an allocated block
+ * of SPAGE_SIZE, holding chunks of one size class (8, 16, ..., 64 bytes).
+ * page_map[] is the page map : the descriptor of the page containing a pointer is found by
+ * its offset in the heap, so mm_free tells small chunks from blocks without reading a header.
+ * Descriptors are kept in leaves of LEAF_PAGES, mapped with mmap when the heap first reaches them,
+ * so the map grows with the heap. If a leaf cannot be mapped, small requests use blocks from then on.
+ * mm_free_sized takes the size class from the size given by the caller.
+ *
+ * - Heap profile
+ * mm_malloc samples allocations by a Poisson process over allocated bytes (mean: sample_rate).
+ * A sampled block has the sampled bit (bit 1) set in its header, and its size and backtrace
+ * are kept in the live sample table until mm_free. mm_realloc moves the sample to the resized
+ * block, keeping the backtrace of the first allocation. mm_heap_profile prints the live samples
+ * in the pprof (heap_v2) text format.
+ *
+ * - Remote free
+ * The heap is owned by the thread that called mm_init. mm_free from any other thread
+ * pushes the block onto remote_head, a lock-free stack linked through the payloads (one CAS).
+ * The owner takes the whole stack with one atomic exchange on its next mm_malloc / mm_realloc
+ * and frees the blocks in a batch. mm_malloc and mm_realloc are called by the owner only.
+ *
  * - ETC
  * 8-byte Alignment, Every block has minimum size of 4 * WSIZE (HEADER, FOOTER, 2 PayLoad or Prev free and Next free pointers)
   */
@@ -35,9 +63,13 @@
 #include <assert.h>
 #include <unistd.h>
 #include <string.h>
+#include <execinfo.h>
+#include <pthread.h>
+#include <sys/mman.h>
 
 #include "mm.h"
 #include "memlib.h"
+#include "mm_ext.h"
 
 /* single word (4) or double word (8) alignment */
 #define ALIGNMENT 8
@@ -53,6 +85,7 @@
 #define CHUNKSIZE (1<<6)	// Extend heap by this amount (bytes)
 
 #define MAX(x, y) ((x) > (y) ? (x) : (y))
+#define MIN(x, y) ((x) < (y) ? (x) : (y))
 
 /* Pack a size and allocated bit into a word */
 #define PACK(size, alloc) ((size) | (alloc))
@@ -65,6 +98,10 @@
 #define GET_SIZE(p)  (GET(p) & ~0x7)
 #define GET_ALLOC(p) (GET(p) & 0x1)
 
+/* Sampled bit of allocated block header (heap profile) */
+#define SAMPLED 0x2
+#define GET_SAMPLED(p) (GET(p) & SAMPLED)
+
 /* Given block ptr bp, compute address of its header and footer */
 #define HDRP(bp) ((char *)(bp) - WSIZE)
 #define FTRP(bp) ((char *)(bp) + GET_SIZE(HDRP(bp)) - DSIZE)
@@ -87,9 +124,41 @@
 #define PREV_BLK_SEG(bp) (*(char **)(bp))
 #define NEXT_BLK_SEG(bp) (*(char **)(NEXT_BLKP_SEG(bp)))
 
+/* Next block pointer of the remote free stack (payload) */
+#define REMOTE_NEXT(bp) (*(void **)(bp))
+
 /* Pick a list by the index */
 #define GET_LIST(ptr, index) *((char **)ptr + index)
 
+/* Maximum count of reclaim callbacks */
+#define MAX_RECLAIM 8
+
+/* Basic constants for small blocks */
+#define SMALL_MAX 64		// Maximum size of small blocks
+#define SMALL_CLASSES 8		// Size classes : 8, 16, ..., SMALL_MAX
+#define SPAGE_SHIFT 12
+#define SPAGE_SIZE (1<<SPAGE_SHIFT)	// Small page size
+#define LEAF_SHIFT 10
+#define LEAF_PAGES (1<<LEAF_SHIFT)	// Descriptors in a page map leaf
+#define MAX_LEAVES (1<<(32 - SPAGE_SHIFT - LEAF_SHIFT))	// Page map covers 4GB of heap
+
+/* Size class of small size, and chunk size of size class */
+#define SMALL_CLASS(size) (((size) + (DSIZE - 1)) / DSIZE)
+#define CLASS_SIZE(cls) ((cls) * DSIZE)
+
+/* Next free chunk in small page (payload) */
+#define CHUNK_NEXT(cp) (*(void **)(cp))
+
+/* Basic constants for heap profile */
+#define SAMPLE_RATE (512 * 1024)	// Default mean bytes between samples
+#define MAX_SAMPLES 4096			// Maximum count of live samples
+#define SAMPLE_BUCKETS 1024			// Buckets of the live sample table (power of 2)
+#define MAX_DEPTH 16				// Maximum backtrace depth
+#define SKIP_DEPTH 2				// profile_alloc, mm_malloc (both noinline)
+
+/* Bucket of the sampled block pointer */
+#define SAMPLE_HASH(ptr) ((((size_t)(ptr)) >> 3) & (SAMPLE_BUCKETS - 1))
+
 /* Functions */
 static void *extend_heap(size_t words);
 static void free_insert(void *bp, size_t size);
@@ -97,11 +166,70 @@ static void free_remove(void *bp);
 static void *free_find(size_t size);
 static void *coalesce(void *bp);
 static void *addblock(void *bp, size_t size);
+static void *reclaim(size_t size);
+static void free_block(void *bp);
+static void remote_drain(void);
+static void *block_malloc(size_t size);
+static void *small_malloc(size_t size);
+static struct page *page_of(void *ptr);
+static void small_free(struct page *page, void *cp);
+static long next_sample(void);
+static void profile_alloc(void *bp, size_t size) __attribute__((noinline));
+static struct sample *profile_take(void *bp);
+static void *profile_keep(struct sample *s, void *bp, size_t size);
+static void profile_free(void *bp);
+
+/* Reclaim callback */
+typedef struct {
+	mm_reclaim_fn fn;
+	void *arg;
+} reclaim_t;
+
+/* Small page descriptor */
+typedef struct page {
+	int cls;				/* Size class, 0 if not a small page */
+	int inuse;				/* Allocated chunks */
+	char *bp;				/* Page (payload of the block) */
+	void *free;				/* Free chunk list */
+	struct page *prev;		/* Pages of the class with free chunks */
+	struct page *next;
+} page_t;
+
+/* Live sample */
+typedef struct sample {
+	void *ptr;					/* Sampled block */
+	size_t size;				/* Requested size */
+	int depth;
+	void *stack[MAX_DEPTH];		/* Backtrace of mm_malloc caller */
+	struct sample *next;		/* Next sample in the bucket or free sample */
+} sample_t;
 
 /* Static variables */
 static char *heap_listp = 0; /* Start point of the heap */
 static void *seg_listp;  	 /* Start point of the segregated lists */
 
+static size_t soft_limit = 0;				/* Soft heap limit, 0 if unset */
+static reclaim_t reclaim_list[MAX_RECLAIM];	/* Registered reclaim callbacks */
+static int reclaim_cnt = 0;
+static int in_reclaim = 0;					/* Callbacks are running */
+static size_t freed_bytes = 0;				/* Bytes freed by mm_free */
+static mm_stats_t stats;
+
+static char *heap_lo;							/* Bottom of the heap, base of the page map */
+static page_t *page_map[MAX_LEAVES];			/* Page map leaves, NULL until the heap reaches them */
+static int small_off;							/* A leaf could not be mapped, no more small pages */
+static page_t *small_list[SMALL_CLASSES + 1];	/* Pages with free chunks by size class */
+
+static pthread_t heap_owner;		/* Thread that called mm_init */
+static void *remote_head = NULL;	/* Blocks freed by other threads */
+
+static size_t sample_rate = SAMPLE_RATE;			/* Mean bytes between samples, 0 disables */
+static long bytes_until_sample;						/* Bytes to allocate before next sample */
+static unsigned long long sample_seed = 88172645463325252ULL;
+static sample_t samples[MAX_SAMPLES];
+static sample_t *sample_table[SAMPLE_BUCKETS];		/* Live samples by block pointer */
+static sample_t *sample_free;						/* Free samples */
+
 /* 
  * mm_init - Initialize segregated lists and the malloc package.
  * Return : Success 0, Error -1
@@ -110,6 +238,33 @@ int mm_init(void)
 {
 	int list;
 
+	/* Reset statistics, the soft limit and callbacks are kept */
+	memset(&stats, 0, sizeof(stats));
+	freed_bytes = 0;
+	in_reclaim = 0;
+
+	/* Calling thread owns the new heap */
+	heap_owner = pthread_self();
+	remote_head = NULL;
+
+	/* Empty page map, leaves are kept for the new heap */
+	heap_lo = mem_heap_lo();
+	for(list = 0; list < MAX_LEAVES; list++) {
+		if(page_map[list]) memset(page_map[list], 0, LEAF_PAGES * sizeof(page_t));
+	}
+	small_off = 0;
+	memset(small_list, 0, sizeof(small_list));
+
+	/* Samples of the previous heap are dead */
+	memset(sample_table, 0, sizeof(sample_table));
+	sample_free = NULL;
+	for(list = 0; list < MAX_SAMPLES; list++) {
+		samples[list].ptr = NULL;
+		samples[list].next = sample_free;
+		sample_free = &samples[list];
+	}
+	bytes_until_sample = next_sample();
+
 	/* Bottom of heap is used segregated lists space */
 	seg_listp = mem_sbrk(MAX_SEGLIST * WSIZE);
 
@@ -141,6 +296,12 @@ static void *extend_heap(size_t words) {
 
 	/* 8-bytes alignment */
 	size = (((words + 1) >> 1) << 1) * WSIZE;
+
+	/* Crossing the soft limit, let the clients free memory first */
+	if(soft_limit && !in_reclaim && (mem_heapsize() + size > soft_limit)) {
+		if((bp = reclaim(size)) != NULL) return bp;
+	}
+
 	if((long)(bp = mem_sbrk(size)) == -1) return NULL;
 
 	/* Initialize free block header/footer and the epilogue header */
@@ -153,6 +314,30 @@ static void *extend_heap(size_t words) {
 	return coalesce(bp);
 }
 
+/*
+ * reclaim - Call reclaim callbacks until a free block of size fits
+ * Return : Free block, NULL if the heap still has to grow
+ */
+static void *reclaim(size_t size) {
+	size_t before = freed_bytes;
+	size_t over = mem_heapsize() + size - soft_limit;
+	void *bp = NULL;
+	int i;
+
+	stats.limit_hits++;
+	in_reclaim = 1;	// Callbacks may call mm_malloc, do not recurse
+
+	for(i = 0; i < reclaim_cnt; i++) {
+		reclaim_list[i].fn(over, reclaim_list[i].arg);
+		if((bp = free_find(size)) != NULL) break;
+	}
+
+	in_reclaim = 0;
+	stats.reclaimed_bytes += freed_bytes - before;
+
+	return bp;
+}
+
 /*
  * free_insert - Insert free block into segregated list 
  */
@@ -349,19 +534,43 @@ static void *addblock(void *bp, size_t size) {
 }
 
 /* 
- * mm_malloc - First, find valid location into the free list, if there is no valid location, extend heap
- *     Always allocate a block whose size is a multiple of the alignment.
+ * mm_malloc - Small sizes are served from small pages, others by block_malloc
+ * 			   Not inlined, the heap profile skips exactly its frame.
  */
-void *mm_malloc(size_t size)
+__attribute__((noinline)) void *mm_malloc(size_t size)
 {
-    size_t new_size;
-	size_t add_heap_size;
-	char *bp;
+	int sampled;
 	char *p;
 
 	/* Size is 0 */
 	if(size == 0) return NULL;
 
+	/* Free blocks from other threads first */
+	if(__atomic_load_n(&remote_head, __ATOMIC_RELAXED) != NULL) remote_drain();
+
+	/* Sample once every sample_rate bytes on average, sampled blocks need a header */
+	sampled = sample_rate && (bytes_until_sample -= (long)size) < 0;
+
+	if(size <= SMALL_MAX && !sampled && !small_off) {
+		if((p = small_malloc(size)) != NULL) return p;
+	}
+
+	if((p = block_malloc(size)) == NULL) return NULL;
+	if(sampled) profile_alloc(p, size);
+	
+	return p;
+}
+
+/* 
+ * block_malloc - First, find valid location into the free list, if there is no valid location, extend heap
+ *     Always allocate a block whose size is a multiple of the alignment.
+ */
+static void *block_malloc(size_t size) {
+    size_t new_size;
+	size_t add_heap_size;
+	char *bp;
+	char *p;
+
 	/* Set size considering overhead */
 	if(size <= DSIZE) new_size = 2 * DSIZE;
 	else new_size = DSIZE * ((size + (DSIZE) + (DSIZE - 1)) / DSIZE);
@@ -369,31 +578,331 @@ void *mm_malloc(size_t size)
 	/* Find valid location into the free list */
 	if((bp = free_find(new_size)) != NULL) {
 		p = addblock(bp, new_size);
-		return p;
 	}
 
 	/* Not found, extend heap */
-	add_heap_size = MAX(new_size, CHUNKSIZE);
-	if((bp = extend_heap(add_heap_size/WSIZE)) == NULL) return NULL;
-	p = addblock(bp, new_size);	
-	
+	else {
+		add_heap_size = MAX(new_size, CHUNKSIZE);
+		if((bp = extend_heap(add_heap_size/WSIZE)) == NULL) return NULL;
+		p = addblock(bp, new_size);	
+	}
+
 	return p;
 }
 
+/*
+ * page_of - Find the small page descriptor of ptr
+ * Return : Descriptor, NULL if ptr is not in a small page
+ */
+static page_t *page_of(void *ptr) {
+	size_t index = (size_t)((char *)ptr - heap_lo) >> SPAGE_SHIFT;
+	page_t *leaf;
+
+	if((index >> LEAF_SHIFT) >= MAX_LEAVES || (leaf = page_map[index >> LEAF_SHIFT]) == NULL) return NULL;
+	leaf += index & (LEAF_PAGES - 1);
+
+	return leaf->cls ? leaf : NULL;
+}
+
+/*
+ * page_slot - Find the descriptor of the small page pg, mapping its leaf of the page map first
+ * Return : Descriptor, NULL if the leaf cannot be mapped
+ */
+static page_t *page_slot(char *pg) {
+	size_t index = (size_t)(pg - heap_lo) >> SPAGE_SHIFT;
+	page_t **leaf;
+	void *p;
+
+	if((index >> LEAF_SHIFT) >= MAX_LEAVES) return NULL;
+	leaf = &page_map[index >> LEAF_SHIFT];
+	if(*leaf == NULL) {
+		p = mmap(NULL, LEAF_PAGES * sizeof(page_t), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if(p == MAP_FAILED) return NULL;
+		*leaf = p;
+	}
+
+	return *leaf + (index & (LEAF_PAGES - 1));
+}
+
+/*
+ * page_carve - Take an aligned small page block from a free block of twice the page size
+ */
+static char *page_carve(void) {
+	char *bp, *pg, *np;
+	size_t size, lead, psize;
+
+	if((bp = block_malloc(2 * SPAGE_SIZE)) == NULL) return NULL;
+	size = GET_SIZE(HDRP(bp));
+
+	/* Leading free block must be 0 or minimum block size */
+	lead = (SPAGE_SIZE - ((size_t)(bp - heap_lo) & (SPAGE_SIZE - 1))) & (SPAGE_SIZE - 1);
+	if(lead && lead < (2 * DSIZE)) lead += SPAGE_SIZE;
+	pg = bp + lead;
+
+	/* Trailing block smaller than minimum block size stays in the page block */
+	psize = SPAGE_SIZE;
+	if(size - lead - psize < (2 * DSIZE)) psize = size - lead;
+
+	PUT(HDRP(pg), PACK(psize, 1));
+	PUT(FTRP(pg), PACK(psize, 1));
+	if(size - lead > psize) {
+		np = NEXT_BLKP(pg);
+		PUT(HDRP(np), PACK(size - lead - psize, 1));
+		PUT(FTRP(np), PACK(size - lead - psize, 1));
+		free_block(np);
+	}
+	if(lead) {
+		PUT(HDRP(bp), PACK(lead, 1));
+		PUT(FTRP(bp), PACK(lead, 1));
+		free_block(bp);
+	}
+
+	return pg;
+}
+
+/*
+ * page_extend - Extend the heap by an aligned small page block
+ */
+static char *page_extend(void) {
+	char *bp, *pg;
+	size_t lead;
+
+	/* Old epilogue becomes the header of the leading free block or the page block */
+	bp = (char *)mem_heap_hi() + 1;
+	lead = (SPAGE_SIZE - ((size_t)(bp - heap_lo) & (SPAGE_SIZE - 1))) & (SPAGE_SIZE - 1);
+	if(lead && lead < (2 * DSIZE)) lead += SPAGE_SIZE;
+
+	if((long)(bp = mem_sbrk(lead + SPAGE_SIZE)) == -1) return NULL;
+	pg = bp + lead;
+
+	PUT(HDRP(pg), PACK(SPAGE_SIZE, 1));
+	PUT(FTRP(pg), PACK(SPAGE_SIZE, 1));
+	PUT(HDRP(NEXT_BLKP(pg)), PACK(0, 1));	/* New epilogue header */
+	if(lead) {
+		PUT(HDRP(bp), PACK(lead, 1));
+		PUT(FTRP(bp), PACK(lead, 1));
+		free_block(bp);
+	}
+
+	return pg;
+}
+
+/*
+ * page_alloc - Allocate a small page for class cls
+ * 				The page is the payload of a block of SPAGE_SIZE, so pages at the heap top tile exactly.
+ * Return : Descriptor, NULL if there is no memory or the page map cannot grow
+ */
+static page_t *page_alloc(int cls) {
+	char *pg, *cp;
+	page_t *page;
+
+	/* Free memory first, the heap top does not waste a page for alignment */
+	if(free_find(2 * SPAGE_SIZE + DSIZE) != NULL || (soft_limit && mem_heapsize() + 2 * SPAGE_SIZE > soft_limit)) {
+		pg = page_carve();
+	}
+	else pg = page_extend();
+
+	if(pg == NULL) return NULL;
+
+	/* Page map cannot grow, mm_malloc stops asking for small pages */
+	if((page = page_slot(pg)) == NULL) {
+		small_off = 1;
+		free_block(pg);
+		return NULL;
+	}
+
+	/* Descriptor and free chunk list, the last DSIZE bytes are the footer and the next header */
+	page->cls = cls;
+	page->inuse = 0;
+	page->bp = pg;
+	page->free = NULL;
+	for(cp = pg + ((SPAGE_SIZE - DSIZE) / CLASS_SIZE(cls) - 1) * CLASS_SIZE(cls); cp >= pg; cp -= CLASS_SIZE(cls)) {
+		CHUNK_NEXT(cp) = page->free;
+		page->free = cp;
+	}
+
+	page->prev = NULL;
+	page->next = small_list[cls];
+	if(small_list[cls]) small_list[cls]->prev = page;
+	small_list[cls] = page;
+	stats.small_pages++;
+
+	return page;
+}
+
+/*
+ * small_unlink - Remove small page from the list of its class
+ */
+static void small_unlink(page_t *page) {
+	if(page->prev) page->prev->next = page->next;
+	else small_list[page->cls] = page->next;
+	if(page->next) page->next->prev = page->prev;
+	page->prev = page->next = NULL;
+}
+
+/*
+ * small_malloc - Take a chunk from a small page of the size class
+ * Return : Chunk, NULL if no small page is available
+ */
+static void *small_malloc(size_t size) {
+	int cls = SMALL_CLASS(size);
+	page_t *page = small_list[cls];
+	void *cp;
+
+	if(page == NULL && (page = page_alloc(cls)) == NULL) return NULL;
+
+	cp = page->free;
+	page->free = CHUNK_NEXT(cp);
+	page->inuse++;
+
+	/* Full page leaves the list */
+	if(page->free == NULL) small_unlink(page);
+
+	return cp;
+}
+
+/*
+ * small_free - Return a chunk to its small page, release the page if it is empty
+ */
+static void small_free(page_t *page, void *cp) {
+	int cls = page->cls;
+
+	/* Full page goes back to the list */
+	if(page->free == NULL) {
+		page->prev = NULL;
+		page->next = small_list[cls];
+		if(small_list[cls]) small_list[cls]->prev = page;
+		small_list[cls] = page;
+	}
+
+	CHUNK_NEXT(cp) = page->free;
+	page->free = cp;
+	page->inuse--;
+
+	/* Keep the last page of the class */
+	if(page->inuse == 0 && (page->prev || page->next)) {
+		small_unlink(page);
+		page->cls = 0;
+		stats.small_pages--;
+		free_block(page->bp);
+	}
+}
+
 /*
  * mm_free - Freeing a block does nothing.
  * 			 Insert freed block into the free list and coalesce
+ * 			 Other threads push the block onto the remote free stack of the owner.
  */
 void mm_free(void *ptr)
 {
-	size_t size = GET_SIZE(HDRP(ptr));
+	void *head;
+
+	if(pthread_equal(pthread_self(), heap_owner)) {
+		free_block(ptr);
+		return;
+	}
+
+	/* Remote free : push with CAS */
+	head = __atomic_load_n(&remote_head, __ATOMIC_RELAXED);
+	do {
+		REMOTE_NEXT(ptr) = head;
+	} while(!__atomic_compare_exchange_n(&remote_head, &head, ptr, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+	__atomic_fetch_add(&stats.remote_frees, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * remote_drain - Free all blocks of the remote free stack (owner only)
+ */
+static void remote_drain(void) {
+	void *bp = __atomic_exchange_n(&remote_head, NULL, __ATOMIC_ACQUIRE);
+	void *next;
+
+	stats.remote_drains++;
+	while(bp != NULL) {
+		next = REMOTE_NEXT(bp);
+		free_block(bp);
+		bp = next;
+	}
+}
+
+/*
+ * mm_free_sized - Free ptr allocated with size bytes
+ * 				   Small chunks go to their page without reading a header.
+ */
+void mm_free_sized(void *ptr, size_t size)
+{
+	page_t *page;
+
+	if(size <= SMALL_MAX && pthread_equal(pthread_self(), heap_owner)) {
+		/* Else, not in a small page (sampled or fallback block) */
+		if((page = page_of(ptr)) != NULL && page->cls == SMALL_CLASS(size)) {
+			small_free(page, ptr);
+			return;
+		}
+	}
+
+	mm_free(ptr);
+}
+
+/*
+ * free_block - Insert freed block into the free list and coalesce (owner only)
+ * 				Small chunks go back to their small page.
+ */
+static void free_block(void *ptr) {
+	size_t size;
+	page_t *page;
+
+	if((page = page_of(ptr)) != NULL) {
+		small_free(page, ptr);
+		return;
+	}
+
+	size = GET_SIZE(HDRP(ptr));
 
+	if(GET_SAMPLED(HDRP(ptr))) profile_free(ptr);
+
+	freed_bytes += size;
 	PUT(HDRP(ptr), PACK(size, 0));
 	PUT(FTRP(ptr), PACK(size, 0));
 	free_insert(ptr, size);
 	coalesce(ptr);
 }
 
+/*
+ * mm_set_soft_limit - Set the soft heap limit (bytes), 0 removes it
+ */
+void mm_set_soft_limit(size_t bytes)
+{
+	soft_limit = bytes;
+}
+
+/*
+ * mm_register_reclaim - Register a callback called before the heap grows past the soft limit
+ * 						 Callbacks are called in registration order.
+ * Return : Success 0, Error -1
+ */
+int mm_register_reclaim(mm_reclaim_fn fn, void *arg)
+{
+	if(fn == NULL || reclaim_cnt >= MAX_RECLAIM) return -1;
+
+	reclaim_list[reclaim_cnt].fn = fn;
+	reclaim_list[reclaim_cnt].arg = arg;
+	reclaim_cnt++;
+
+	return 0;
+}
+
+/*
+ * mm_get_stats - Copy allocator statistics
+ */
+void mm_get_stats(mm_stats_t *st)
+{
+	*st = stats;
+	st->heap_size = mem_heapsize();
+	st->soft_limit = soft_limit;
+}
+
 /*
  * mm_realloc - Special case : ptr is NULL, size is 0, New Size = Old Size
  * 				3 Cases : New Size < Old Size, Old Size + Next Size > New Size > Old Size, New Size > Old Size + Next Size  
@@ -405,25 +914,43 @@ void *mm_realloc(void *ptr, size_t size)
 	void *nextptr;
     size_t copySize;
 	size_t newSize, nextSize;
+	page_t *smallp;
+	sample_t *s = NULL;
 
 	/* ptr is NULL */
 	if(ptr == NULL) return mm_malloc(size);
 
+	/* Neighbors may be in the remote free stack */
+	if(__atomic_load_n(&remote_head, __ATOMIC_RELAXED) != NULL) remote_drain();
+
 	/* size is 0 */
 	if(size == 0) {
 		mm_free(ptr);
 		return NULL;	
 	}
 
+	/* Small chunk : move to a new location */
+	if((smallp = page_of(oldptr)) != NULL) {
+		copySize = CLASS_SIZE(smallp->cls);
+		if(size <= copySize && SMALL_CLASS(size) == smallp->cls) return oldptr;
+		if((newptr = mm_malloc(size)) == NULL) return NULL;
+		memcpy(newptr, oldptr, MIN(size, copySize));
+		small_free(smallp, oldptr);
+		return newptr;
+	}
+
+	/* Sampled block keeps its sample, put back on the resized block */
+	if(GET_SAMPLED(HDRP(oldptr))) s = profile_take(oldptr);
+
 	newSize = ALIGN(size);
 	copySize = GET_SIZE(HDRP(oldptr)) - DSIZE;
 
 	/* New Size is same as Old Size, do nothing */
-	if(newSize == copySize) return ptr;
+	if(newSize == copySize) return profile_keep(s, ptr, size);
 
 	/* New Size < Old Size */
 	if(newSize < copySize) {
-		if(copySize - newSize - DSIZE <= DSIZE) return oldptr;	// 8-byte alignment
+		if(copySize - newSize - DSIZE <= DSIZE) return profile_keep(s, oldptr, size);	// 8-byte alignment
 
 		PUT(HDRP(oldptr), PACK(newSize + DSIZE, 1));
 		PUT(FTRP(oldptr), PACK(newSize + DSIZE, 1));
@@ -436,7 +963,7 @@ void *mm_realloc(void *ptr, size_t size)
 		free_insert(oldptr, GET_SIZE(HDRP(oldptr)));
 		coalesce(oldptr);
 
-		return newptr;
+		return profile_keep(s, newptr, size);
 	}
 	
 	/* New Size > Old Size */
@@ -452,7 +979,7 @@ void *mm_realloc(void *ptr, size_t size)
 			if(nextSize + copySize - newSize <= DSIZE) {	// 8-byte alignment
 				PUT(HDRP(oldptr), PACK(copySize + nextSize + DSIZE, 1));
 				PUT(FTRP(oldptr), PACK(copySize + nextSize + DSIZE, 1));
-				return oldptr;		
+				return profile_keep(s, oldptr, size);
 			}
 			else {
 				PUT(HDRP(oldptr), PACK(newSize + DSIZE, 1));
@@ -463,19 +990,207 @@ void *mm_realloc(void *ptr, size_t size)
 				PUT(FTRP(oldptr), PACK(copySize + nextSize - newSize, 0));
 				free_insert(oldptr, GET_SIZE(HDRP(oldptr)));
 				coalesce(oldptr);
-				return newptr;
+				return profile_keep(s, newptr, size);
 			}
 		}
 	}
 
-	/* Need new fit block */		
-	newptr = mm_malloc(size);
+	/* Need new fit block, a sampled one needs a header */		
+	newptr = s ? block_malloc(size) : mm_malloc(size);
 	
-	if(newptr == NULL) return NULL;
+	if(newptr == NULL) {
+		if(s) profile_keep(s, oldptr, s->size);
+		return NULL;
+	}
 
 	memcpy(newptr, oldptr, copySize);
 	mm_free(oldptr);
-	return newptr;
+	return profile_keep(s, newptr, size);
+}
+
+/*
+ * fast_log2 - Approximate log2(x) for x > 0 from the exponent and the mantissa
+ */
+static double fast_log2(double x) {
+	union {
+		double d;
+		unsigned long long u;
+	} v;
+	int e;
+
+	v.d = x;
+	e = (int)((v.u >> 52) & 0x7ff) - 1024;
+	v.u = (v.u & 0x000fffffffffffffULL) | 0x3ff0000000000000ULL;	// Mantissa in [1, 2)
+
+	/* Quadratic approximation of 1 + log2(mantissa) */
+	return e + (-0.34484843 * v.d + 2.02466578) * v.d - 0.67487759;
+}
+
+/*
+ * next_sample - Pick bytes until the next sample, exponentially distributed with mean sample_rate
+ */
+static long next_sample(void) {
+	unsigned long long q;
+
+	if(sample_rate == 0) return 0;
+
+	/* xorshift64 */
+	sample_seed ^= sample_seed << 13;
+	sample_seed ^= sample_seed >> 7;
+	sample_seed ^= sample_seed << 17;
+	q = (sample_seed >> 38) + 1;	// Uniform in [1, 2^26]
+
+	/* -ln(q / 2^26) * sample_rate */
+	return (long)((26 - fast_log2((double)q)) * 0.6931471805599453 * (double)sample_rate) + 1;
+}
+
+/*
+ * profile_alloc - Record a sampled block with the backtrace of its caller
+ */
+static void profile_alloc(void *bp, size_t size) {
+	void *stack[MAX_DEPTH + SKIP_DEPTH];
+	sample_t *s;
+	int depth;
+
+	bytes_until_sample = next_sample();
+
+	/* Table is full */
+	if((s = sample_free) == NULL) {
+		stats.dropped_samples++;
+		return;
+	}
+	sample_free = s->next;
+
+	depth = backtrace(stack, MAX_DEPTH + SKIP_DEPTH) - SKIP_DEPTH;
+	if(depth < 0) depth = 0;
+	memcpy(s->stack, stack + SKIP_DEPTH, depth * sizeof(void *));
+	s->depth = depth;
+	s->ptr = bp;
+	s->size = size;
+	s->next = sample_table[SAMPLE_HASH(bp)];
+	sample_table[SAMPLE_HASH(bp)] = s;
+
+	PUT(HDRP(bp), GET(HDRP(bp)) | SAMPLED);
+	stats.live_samples++;
+}
+
+/*
+ * profile_take - Unlink the sample of a sampled block from the live sample table
+ * Return : Sample, NULL if it is not in the table
+ */
+static sample_t *profile_take(void *bp) {
+	sample_t **sp = &sample_table[SAMPLE_HASH(bp)];
+	sample_t *s;
+
+	PUT(HDRP(bp), GET(HDRP(bp)) & ~SAMPLED);
+
+	while((s = *sp) != NULL) {
+		if(s->ptr == bp) {
+			*sp = s->next;
+			return s;
+		}
+		sp = &s->next;
+	}
+
+	return NULL;
+}
+
+/*
+ * profile_keep - Put a taken sample back on block bp of size bytes
+ * Return : bp
+ */
+static void *profile_keep(sample_t *s, void *bp, size_t size) {
+	if(s == NULL) return bp;
+
+	s->ptr = bp;
+	s->size = size;
+	s->next = sample_table[SAMPLE_HASH(bp)];
+	sample_table[SAMPLE_HASH(bp)] = s;
+	PUT(HDRP(bp), GET(HDRP(bp)) | SAMPLED);
+
+	return bp;
+}
+
+/*
+ * profile_free - Remove a sampled block from the live sample table
+ */
+static void profile_free(void *bp) {
+	sample_t *s;
+
+	if((s = profile_take(bp)) == NULL) return;
+
+	s->ptr = NULL;
+	s->next = sample_free;
+	sample_free = s;
+	stats.live_samples--;
+}
+
+/*
+ * mm_set_sample_rate - Set mean bytes between heap profile samples, 0 disables sampling
+ */
+void mm_set_sample_rate(size_t bytes)
+{
+	sample_rate = bytes;
+	bytes_until_sample = next_sample();
+}
+
+/*
+ * mm_heap_profile - Print live samples in the pprof heap profile format
+ * 					 Samples with the same backtrace are merged into one line.
+ * Return : Success 0, Error -1
+ */
+int mm_heap_profile(FILE *fp)
+{
+	static char merged[MAX_SAMPLES];
+	sample_t *s, *t;
+	unsigned long count, total_count = 0;
+	size_t bytes, total_bytes = 0;
+	int i, j, d;
+	FILE *maps;
+	char buf[256];
+	size_t n;
+
+	for(i = 0; i < MAX_SAMPLES; i++) merged[i] = 0;
+
+	/* Totals first, sampled data is unsampled by pprof (heap_v2) */
+	for(i = 0; i < SAMPLE_BUCKETS; i++) {
+		for(s = sample_table[i]; s != NULL; s = s->next) {
+			total_count++;
+			total_bytes += s->size;
+		}
+	}
+	if(fprintf(fp, "heap profile: %lu: %lu [ %lu: %lu] @ heap_v2/%lu\n", total_count, (unsigned long)total_bytes,
+			   total_count, (unsigned long)total_bytes, (unsigned long)sample_rate) < 0) return -1;
+
+	/* One line per backtrace */
+	for(i = 0; i < MAX_SAMPLES; i++) {
+		s = &samples[i];
+		if(merged[i] || s->ptr == NULL) continue;	// Merged or free sample
+		count = 0;
+		bytes = 0;
+
+		for(j = i; j < MAX_SAMPLES; j++) {
+			t = &samples[j];
+			if(merged[j] || t->ptr == NULL || t->depth != s->depth) continue;
+			if(memcmp(t->stack, s->stack, s->depth * sizeof(void *))) continue;
+			merged[j] = 1;
+			count++;
+			bytes += t->size;
+		}
+
+		fprintf(fp, "%lu: %lu [%lu: %lu] @", count, (unsigned long)bytes, count, (unsigned long)bytes);
+		for(d = 0; d < s->depth; d++) fprintf(fp, " %p", s->stack[d]);
+		fprintf(fp, "\n");
+	}
+
+	/* Mappings to symbolize the addresses */
+	fprintf(fp, "\nMAPPED_LIBRARIES:\n");
+	if((maps = fopen("/proc/self/maps", "r")) != NULL) {
+		while((n = fread(buf, 1, sizeof(buf), maps)) > 0) fwrite(buf, 1, n, fp);
+		fclose(maps);
+	}
+
+	return ferror(fp) ? -1 : 0;
 }
 
 /*
@@ -0,0 +1,129 @@
+/* 2013-11826, JuGyeong Lim
+ *
+ * mm-remote-test.c - Producer / consumer trace for remote free
+ *
+ * The producer (the heap owner) allocates blocks of 1 ~ MAX_SIZE bytes, fills each with a byte
+ * of its sequence number and passes them to the consumer through a single-producer ring.
+ * The consumer checks the bytes and frees the blocks, so every mm_free is a remote free.
+ * At the end every block must have been freed remotely, and the heap must not have grown
+ * past a few rings of live blocks, which shows the owner drains the remote stack.
+ *
+ * mm.h, memlib.c, memlib.h and config.h come with the malloclab handout, they are not in this
+ * directory. Copy them next to this file, and mm-2013-11826.c to mm.c as the handout expects :
+ *   cp mm-2013-11826.c mm.c
+ *   gcc -m32 -O2 -Wall -o mm-remote-test mm-remote-test.c mm.c memlib.c -lpthread
+ *   ./mm-remote-test [blocks]
+ * The free list links are 4 bytes (PUT_SEG, PREV_BLK_SEG, NEXT_BLK_SEG), so the allocator runs
+ * as a 32-bit (-m32) build. For a 64-bit build, widen those macros first : keep the links 4 bytes
+ * but cast through unsigned long, map the memlib heap below 4GB (MAP_32BIT), and reserve
+ * MAX_SEGLIST * 8 bytes for the list heads in mm_init, which GET_LIST reads as char *.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "mm.h"
+#include "memlib.h"
+#include "mm_ext.h"
+
+#define RING 1024			// Blocks in flight between the threads (power of 2)
+#define MAX_SIZE 256		// Largest block (bytes)
+#define BLOCKS 1000000		// Default blocks passed
+
+/* Ring, the producer moves head and the consumer tail */
+static void *ring[RING];
+static size_t ring_size[RING];
+static unsigned long head, tail;
+static int done;
+static unsigned long errors;
+
+/*
+ * consumer - Check and free the blocks of the ring
+ */
+static void *consumer(void *arg) {
+	unsigned long t = 0;
+	unsigned char *p;
+	size_t i, size;
+
+	while(1) {
+		while(t == __atomic_load_n(&head, __ATOMIC_ACQUIRE)) {
+			if(__atomic_load_n(&done, __ATOMIC_ACQUIRE) && t == __atomic_load_n(&head, __ATOMIC_ACQUIRE)) return NULL;
+			sched_yield();
+		}
+		p = ring[t & (RING - 1)];
+		size = ring_size[t & (RING - 1)];
+		for(i = 0; i < size; i++) {
+			if(p[i] != (unsigned char)t) {
+				errors++;
+				break;
+			}
+		}
+		mm_free(p);
+		__atomic_store_n(&tail, ++t, __ATOMIC_RELEASE);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long n = argc > 1 ? strtoul(argv[1], NULL, 10) : BLOCKS;
+	unsigned long h, seed = 88172645463325252UL;
+	struct timespec start, end;
+	mm_stats_t st;
+	pthread_t tid;
+	size_t size;
+	double sec;
+	void *p;
+
+	mem_init();
+	if(mm_init() < 0) {
+		printf("mm_init failed\n");
+		return 1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	pthread_create(&tid, NULL, consumer, NULL);
+
+	for(h = 0; h < n; h++) {
+		seed ^= seed << 13;
+		seed ^= seed >> 7;
+		seed ^= seed << 17;
+		size = seed % MAX_SIZE + 1;
+
+		if((p = mm_malloc(size)) == NULL) {
+			printf("mm_malloc failed at block %lu\n", h);
+			return 1;
+		}
+		memset(p, (unsigned char)h, size);
+
+		/* Wait for room in the ring */
+		while(h - __atomic_load_n(&tail, __ATOMIC_ACQUIRE) >= RING) sched_yield();
+		ring[h & (RING - 1)] = p;
+		ring_size[h & (RING - 1)] = size;
+		__atomic_store_n(&head, h + 1, __ATOMIC_RELEASE);
+	}
+
+	__atomic_store_n(&done, 1, __ATOMIC_RELEASE);
+	pthread_join(tid, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	/* Take the last remote frees */
+	mm_free(mm_malloc(1));
+	mm_get_stats(&st);
+	sec = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+	printf("blocks %lu in %.3f s (%.0f blocks/s)\n", n, sec, n / sec);
+	printf("remote frees %lu drains %lu heap %lu bytes\n", st.remote_frees, st.remote_drains, (unsigned long)st.heap_size);
+
+	if(errors) printf("FAIL : %lu blocks were overwritten\n", errors);
+	else if(st.remote_frees != n) printf("FAIL : %lu of %lu blocks freed remotely\n", st.remote_frees, n);
+	else if(st.heap_size > 8 * RING * (MAX_SIZE + 2 * 8)) printf("FAIL : heap grew to %lu bytes\n", (unsigned long)st.heap_size);
+	else {
+		printf("OK\n");
+		return 0;
+	}
+	return 1;
+}
@@ -0,0 +1,34 @@
+/* 2013-11826, JuGyeong Lim
+ *
+ * mm_ext.h - Extensions to the mm.h interface
+ */
+
+#ifndef __MM_EXT_H__
+#define __MM_EXT_H__
+
+#include <stdio.h>
+
+/* Reclaim callback : Asked to free about 'bytes' bytes with mm_free */
+typedef void (*mm_reclaim_fn)(size_t bytes, void *arg);
+
+/* Allocator statistics */
+typedef struct {
+	size_t heap_size;			/* Current heap size (bytes) */
+	size_t soft_limit;			/* Soft heap limit, 0 if unset */
+	unsigned long limit_hits;	/* Heap extensions that would cross the soft limit */
+	size_t reclaimed_bytes;		/* Bytes freed by reclaim callbacks */
+	unsigned long live_samples;	/* Live heap profile samples */
+	unsigned long dropped_samples;	/* Samples dropped, the sample table was full */
+	unsigned long remote_frees;	/* Blocks freed by threads other than the owner */
+	unsigned long remote_drains;	/* Batches of remote frees taken by the owner */
+	unsigned long small_pages;	/* Pages of header-free small blocks */
+} mm_stats_t;
+
+extern void mm_free_sized(void *ptr, size_t size);
+extern void mm_set_soft_limit(size_t bytes);
+extern int mm_register_reclaim(mm_reclaim_fn fn, void *arg);
+extern void mm_get_stats(mm_stats_t *stats);
+extern void mm_set_sample_rate(size_t bytes);
+extern int mm_heap_profile(FILE *fp);
+
+#endif /* __MM_EXT_H__ */
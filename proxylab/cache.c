@@ -0,0 +1,335 @@
+/*
+ * cache.c - Proxy cache
+ *
+ * Objects are kept in a hash table of CACHE_BUCKETS chains, and a lookup
+ * compares the precomputed hash before the URL. Lookups take no lock:
+ * writers, serialized by insertMutex, publish chain pointers with release
+ * stores and readers walk them inside an epoch (see epoch.c). Entries
+ * never change once inserted, but for the expiry revalidation moves
+ * (see fresh.c). A found entry gains a reference before the
+ * reader leaves its epoch, so a hit is written out with no lock held,
+ * however slow the client.
+ *
+ * Every entry is also on one doubly linked LRU list (most recent first).
+ * A hit moves its entry to the front and an insert evicts from the back
+ * until the cached bytes fit in MAX_CACHE_SIZE, both in O(1) per entry.
+ * The move is lazy: an entry already moved since the last insert stays,
+ * since its order among the others only matters to the next eviction,
+ * so hot entries rarely take the LRU lock.
+ *
+ * An evicted entry leaves the index and drops the cache's reference; the
+ * last reader to release it retires it, and it is freed when no reader
+ * can still be walking past it.
+ *
+ * The cache, its slab and its epochs are shared by the worker processes
+ * (see shm.c). The index only ever changes by single pointer stores, so
+ * it stays whole whatever happens to a writer; if one dies holding a
+ * lock, the LRU list and the counts are rebuilt from it.
+ *
+ * An entry lives in one slab chunk sized to it (see slab.c) with its URL
+ * and object behind it, and the budget counts the whole chunk. Entries
+ * loaded from a snapshot point into its mapping instead (see snap.c) and
+ * are counted as if they had a chunk.
+ */
+#include "proxy.h"
+
+void lruUnlink(cacheEntry *e);
+void lruPush(cacheEntry *e);
+void cacheLink(cacheEntry *e);
+void cacheUnlink(cacheEntry *e);
+void cacheRemove(cacheEntry *e);
+void cacheEvict();
+
+cacheSet *cache;
+
+/* Before any worker is forked, the mapping comes zeroed */
+void cacheInit() {
+	cache = shmMap(sizeof(cacheSet), 64);
+	cache->lru.lruPrev = cache->lru.lruNext = &cache->lru;
+	slabInit();
+	epochInit();
+	shmMutexInit(&cache->lruMutex);
+	shmMutexInit(&cache->insertMutex);
+}
+
+/* FNV-1a */
+unsigned int cacheHash(char *url) {
+	unsigned int h = 2166136261u;
+
+	while(*url) {
+		h ^= (unsigned char)*url++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+/*
+ * Takes lruMutex, returning 0 if the list is broken because a holder
+ * died. Holders of insertMutex then rebuild it, others leave it alone.
+ */
+int lruLock() {
+	if(shmLock(&cache->lruMutex)) cache->lruBroken = 1;
+	return !cache->lruBroken;
+}
+
+void lruUnlock() {
+	shmUnlock(&cache->lruMutex);
+}
+
+/*
+ * Rebuilds the LRU list, in no particular order, and the counts from the
+ * index. Entries a dead writer held outside the index are lost to the
+ * budget. Callers hold both locks.
+ */
+static void cacheRepair() {
+	cacheEntry *e;
+	int i;
+
+	cache->lru.lruPrev = cache->lru.lruNext = &cache->lru;
+	cache->bytes = 0;
+	cache->num = 0;
+	for(i = 0; i < CACHE_BUCKETS; i++) {
+		for(e = cache->bucket[i]; e != NULL; e = e->next) {
+			lruPush(e);
+			cache->bytes += slabChunkSize(e->alloc);
+			cache->num++;
+		}
+	}
+	cache->lruBroken = 0;
+	cache->repairs++;
+}
+
+/* Takes lruMutex with insertMutex held, repairing the list if it must */
+static void lruLockRepair() {
+	if(!lruLock()) cacheRepair();
+}
+
+/* Takes insertMutex, repairing what a writer that died with it left */
+static void insertLock() {
+	if(shmLock(&cache->insertMutex) || __atomic_load_n(&cache->lruBroken, __ATOMIC_RELAXED)) {
+		lruLock();
+		cacheRepair();
+		lruUnlock();
+	}
+}
+
+static void insertUnlock() {
+	shmUnlock(&cache->insertMutex);
+}
+
+/* Callers hold lruMutex */
+void lruUnlink(cacheEntry *e) {
+	e->lruPrev->lruNext = e->lruNext;
+	e->lruNext->lruPrev = e->lruPrev;
+	e->lruPrev = e->lruNext = NULL;
+}
+
+void lruPush(cacheEntry *e) {
+	e->lruNext = cache->lru.lruNext;
+	e->lruPrev = &cache->lru;
+	cache->lru.lruNext->lruPrev = e;
+	cache->lru.lruNext = e;
+}
+
+/* Returns the entry with a reference taken, drop it with cacheRelease */
+cacheEntry *cacheFind(char *url, unsigned int hash) {
+	unsigned int b = BUCKET(hash);
+	cacheEntry *e;
+
+	int refs;
+
+	epochEnter();
+	for(e = __atomic_load_n(&cache->bucket[b], __ATOMIC_ACQUIRE); e != NULL; e = __atomic_load_n(&e->next, __ATOMIC_ACQUIRE)) {
+		if(e->hash == hash && strcmp(url, e->url) == 0) {
+			/* A reference only while the count is not zero : at zero it is retired */
+			refs = __atomic_load_n(&e->refs, __ATOMIC_RELAXED);
+			do {
+				if(refs == 0) break;
+			} while(!__atomic_compare_exchange_n(&e->refs, &refs, refs + 1, 1, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+			if(refs == 0) e = NULL;
+			break;
+		}
+	}
+	epochExit();
+
+	if(e != NULL && e->mapped && !snapVerify(e)) {
+		cacheRelease(e);
+		return NULL;
+	}
+
+	/* Most recently used, unless it is being evicted or moved since the last insert */
+	if(e != NULL && __atomic_load_n(&e->lruTick, __ATOMIC_RELAXED) != __atomic_load_n(&cache->inserts, __ATOMIC_RELAXED)) {
+		if(lruLock() && e->lruNext != NULL && cache->lru.lruNext != e) {
+			lruUnlink(e);
+			lruPush(e);
+		}
+		__atomic_store_n(&e->lruTick, cache->inserts, __ATOMIC_RELAXED);
+		lruUnlock();
+	}
+	
+	return e;
+}
+
+void cacheFree(void *p) {
+	cacheEntry *e = p;
+
+	if(e->mapped) slabFree(e, sizeof(cacheEntry));
+	else slabFree(e, e->alloc);
+}
+
+void cacheRelease(cacheEntry *e) {
+	if(__atomic_sub_fetch(&e->refs, 1, __ATOMIC_ACQ_REL) == 0) epochRetire(&e->retire, e, cacheFree);
+}
+
+/* Writers hold insertMutex */
+void cacheLink(cacheEntry *e) {
+	unsigned int b = BUCKET(e->hash);
+
+	e->next = cache->bucket[b];
+	__atomic_store_n(&cache->bucket[b], e, __ATOMIC_RELEASE);
+}
+
+/* Readers already past e keep following its next pointer, which stays */
+void cacheUnlink(cacheEntry *e) {
+	unsigned int b = BUCKET(e->hash);
+	cacheEntry **p;
+
+	for(p = &cache->bucket[b]; *p != NULL; p = &(*p)->next) {
+		if(*p == e) {
+			__atomic_store_n(p, e->next, __ATOMIC_RELEASE);
+			break;
+		}
+	}
+}
+
+/* Takes an entry off the LRU list and out of the index, callers hold insertMutex */
+void cacheRemove(cacheEntry *e) {
+	lruLockRepair();
+	if(e->lruNext != NULL) lruUnlink(e);
+	lruUnlock();
+
+	cacheUnlink(e);
+	cache->bytes -= slabChunkSize(e->alloc);
+	cache->num--;
+}
+
+/* Drops the least recently used entry, callers hold insertMutex */
+void cacheEvict() {
+	cacheEntry *e;
+
+	lruLockRepair();
+	e = cache->lru.lruPrev;
+	lruUnlock();
+
+	cacheRemove(e);
+
+	/* A snapshot entry goes to disk only once its checksum holds */
+	if(cacheFresh(e) && (!e->mapped || snapVerify(e))) diskPut(e->url, e->obj, e->size, e->hdrLen, e->expires);
+
+	/* No new reader can find it, the last one frees it */
+	cacheRelease(e);
+}
+
+int cacheFresh(cacheEntry *e) {
+	return time(NULL) < __atomic_load_n(&e->expires, __ATOMIC_RELAXED);
+}
+
+/* Moves the expiry of an entry that revalidated */
+void cacheRefresh(cacheEntry *e, time_t expires) {
+	__atomic_store_n(&e->expires, expires, __ATOMIC_RELAXED);
+}
+
+/*
+ * Inserts are serialized, evicting until the new object fits
+ * MAX_CACHE_SIZE. fi describes the headers of buf.
+ */
+void cacheURI(char *uri, unsigned int hash, char *buf, size_t size, size_t hdrLen, freshInfo *fi) {
+	cacheEntry *e;
+	size_t urlLen = strlen(uri);
+	size_t alloc = sizeof(cacheEntry) + urlLen + 1 + size;
+	size_t chunk = slabChunkSize(alloc);
+
+	if(chunk == 0 || chunk > MAX_CACHE_SIZE) return;
+
+	insertLock();
+
+	/* Another miss for the same URL filled it first, or left a stale copy to replace */
+	if((e = cacheFind(uri, hash)) != NULL) {
+		if(cacheFresh(e)) {
+			cacheRelease(e);
+			insertUnlock();
+			return;
+		}
+		cacheRemove(e);
+		cacheRelease(e);	/* The lookup's */
+		cacheRelease(e);	/* The cache's */
+	}
+
+	while(cache->num > 0 && cache->bytes + chunk > MAX_CACHE_SIZE) cacheEvict();
+
+	if((e = slabAlloc(alloc)) == NULL) {
+		insertUnlock();
+		return;
+	}
+	e->url = (char *)(e + 1);
+	memcpy(e->url, uri, urlLen + 1);
+	e->obj = e->url + urlLen + 1;
+	memcpy(e->obj, buf, size);
+	e->size = size;
+	e->hdrLen = hdrLen;
+	e->expires = freshUntil(fi);
+	e->refreshing = 0;
+	e->lastModified = fi->lastModified;
+	e->etagOff = fi->etagOff;
+	e->etagLen = fi->etagLen;
+	e->alloc = alloc;
+	e->hash = hash;
+	e->refs = 1;		/* The cache's own */
+	e->mapped = 0;
+	e->lruTick = cache->inserts + 1;
+
+	cache->bytes += chunk;
+	cache->num++;
+	lruLockRepair();
+	lruPush(e);
+	__atomic_store_n(&cache->inserts, cache->inserts + 1, __ATOMIC_RELAXED);
+	lruUnlock();
+	cacheLink(e);
+
+	insertUnlock();
+
+	/* Frees what this and earlier evictions retired, once it is safe */
+	epochReclaim();
+}
+
+/*
+ * Indexes an entry built outside the slab, as the most recently used.
+ * Returns 0, leaving it to the caller, if it does not fit the cache.
+ */
+int cacheAdopt(cacheEntry *e) {
+	size_t chunk = slabChunkSize(e->alloc);
+
+	if(chunk == 0 || chunk > MAX_CACHE_SIZE) return 0;
+
+	insertLock();
+	while(cache->num > 0 && cache->bytes + chunk > MAX_CACHE_SIZE) cacheEvict();
+	e->refs = 1;
+	e->lruTick = cache->inserts + 1;
+	cache->bytes += chunk;
+	cache->num++;
+	lruLockRepair();
+	lruPush(e);
+	__atomic_store_n(&cache->inserts, cache->inserts + 1, __ATOMIC_RELAXED);
+	lruUnlock();
+	cacheLink(e);
+	insertUnlock();
+	return 1;
+}
+
+void cacheStats(FILE *fp) {
+	fprintf(fp, "cache entries %d bytes %lu/%d repairs %lu revalidations %lu not modified %lu\n", cache->num,
+			(unsigned long)cache->bytes, MAX_CACHE_SIZE, cache->repairs, cache->revalidations, cache->notModified);
+	fprintf(fp, "stale served %lu refreshed %lu refresh failures %lu not modified hits %lu head hits %lu\n", cache->staleServed,
+			cache->refreshed, cache->refreshFailures, cache->notModifiedHits, cache->headHits);
+	fflush(fp);
+}
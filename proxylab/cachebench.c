@@ -0,0 +1,97 @@
+/*
+ * cachebench.c - Hit throughput of the cache index, without the network
+ *
+ * Fills the cache with BENCH_URLS small fresh entries, then for 1, 2, 4,
+ * ... reader threads, up to maxThreads (default: the online CPUs), looks
+ * up random URLs with cacheFind and cacheRelease for secs seconds (default
+ * 2). Prints the hits per second of each run and its speedup over one
+ * thread. Lookups take no lock, so the speedup should follow the threads
+ * up to the cores.
+ *
+ *   make cachebench && ./cachebench [maxThreads] [secs]
+ */
+#include "proxy.h"
+
+#define BENCH_URLS 1024
+#define BENCH_MAX_THREADS 64
+
+static char urls[BENCH_URLS][64];
+static unsigned int hashes[BENCH_URLS];
+static volatile int stop;
+
+/* One per thread, a cache line each */
+static struct {
+	unsigned long hits;
+	unsigned long misses;
+	char pad[64 - 2 * sizeof(unsigned long)];
+} counts[BENCH_MAX_THREADS];
+
+static void *reader(void *vargp) {
+	long id = (long)vargp;
+	unsigned int seed = id + 1, i;
+	cacheEntry *e;
+
+	while(!stop) {
+		i = rand_r(&seed) % BENCH_URLS;
+		if((e = cacheFind(urls[i], hashes[i])) != NULL) {
+			counts[id].hits++;
+			cacheRelease(e);
+		}
+		else counts[id].misses++;
+	}
+	return NULL;
+}
+
+/* Runs n readers for secs seconds, returns the hits per second */
+static double run(int n, int secs) {
+	pthread_t tid[BENCH_MAX_THREADS];
+	unsigned long hits = 0, misses = 0;
+	long i;
+
+	memset(counts, 0, sizeof(counts));
+	stop = 0;
+	for(i = 0; i < n; i++) Pthread_create(&tid[i], NULL, reader, (void *)i);
+	sleep(secs);
+	stop = 1;
+	for(i = 0; i < n; i++) {
+		Pthread_join(tid[i], NULL);
+		hits += counts[i].hits;
+		misses += counts[i].misses;
+	}
+	if(misses) fprintf(stderr, "cachebench: %lu misses, the entries did not all fit\n", misses);
+	return (double)hits / secs;
+}
+
+int main(int argc, char **argv) {
+	char obj[256];
+	freshInfo fi;
+	size_t hdrLen;
+	int i, n, maxThreads, secs;
+	double one = 0, rate;
+
+	maxThreads = argc > 1 ? atoi(argv[1]) : sysconf(_SC_NPROCESSORS_ONLN);
+	secs = argc > 2 ? atoi(argv[2]) : 2;
+	if(maxThreads <= 0 || maxThreads > BENCH_MAX_THREADS || secs <= 0) {
+		fprintf(stderr, "usage: %s [maxThreads (1-%d)] [secs]\n", argv[0], BENCH_MAX_THREADS);
+		exit(1);
+	}
+
+	cacheInit();
+	hdrLen = sprintf(obj, "HTTP/1.0 200 OK\r\nCache-Control: max-age=3600\r\nContent-Length: 64\r\n");
+	sprintf(obj + hdrLen, "\r\n%064d", 0);
+	freshParse(obj, hdrLen, time(NULL), &fi);
+	for(i = 0; i < BENCH_URLS; i++) {
+		sprintf(urls[i], "http://bench.example:80/object/%d", i);
+		hashes[i] = cacheHash(urls[i]);
+		cacheURI(urls[i], hashes[i], obj, strlen(obj), hdrLen, &fi);
+	}
+
+	printf("%7s %14s %8s\n", "threads", "hits/s", "speedup");
+	for(n = 1; ; n = n * 2 < maxThreads ? n * 2 : maxThreads) {
+		rate = run(n, secs);
+		if(n == 1) one = rate;
+		printf("%7d %14.0f %7.2fx\n", n, rate, rate / one);
+		if(n == maxThreads) break;
+	}
+	return 0;
+}
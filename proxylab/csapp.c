@@ -853,32 +853,63 @@ ssize_t rio_readnb(rio_t *rp, void *usrbuf, size_t n)
 }
 /* $end rio_readnb */
 
+/*
+ * rio_fill - Refill an empty internal buffer, returns the byte count,
+ *    0 on EOF or -1 on error
+ */
+static ssize_t rio_fill(rio_t *rp)
+{
+    while (rp->rio_cnt <= 0) {
+	rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, sizeof(rp->rio_buf));
+	if (rp->rio_cnt < 0) {
+	    if (errno != EINTR) /* Interrupted by sig handler return */
+		return -1;
+	}
+	else if (rp->rio_cnt == 0)  /* EOF */
+	    return 0;
+	else 
+	    rp->rio_bufptr = rp->rio_buf; /* Reset buffer ptr */
+    }
+    return rp->rio_cnt;
+}
+
 /* 
  * rio_readlineb - Robustly read a text line (buffered)
+ *    Scans the internal buffer with memchr and copies a line segment
+ *    at a time instead of calling rio_read once per byte.
  */
 /* $begin rio_readlineb */
 ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen) 
 {
-    int n, rc;
-    char c, *bufp = usrbuf;
-
-    for (n = 1; n < maxlen; n++) { 
-        if ((rc = rio_read(rp, &c, 1)) == 1) {
-	    *bufp++ = c;
-	    if (c == '\n') {
-                n++;
-     		break;
-            }
-	} else if (rc == 0) {
-	    if (n == 1)
+    size_t n = 0, cnt;
+    ssize_t rc;
+    char *bufp = usrbuf, *nl = NULL;
+
+    while (n + 1 < maxlen) {
+	if ((rc = rio_fill(rp)) < 0)
+	    return -1;	  /* Error */
+	else if (rc == 0) {
+	    if (n == 0)
 		return 0; /* EOF, no data read */
 	    else
 		break;    /* EOF, some data was read */
-	} else
-	    return -1;	  /* Error */
+	}
+
+	cnt = maxlen - 1 - n;
+	if (rp->rio_cnt < cnt)
+	    cnt = rp->rio_cnt;
+	if ((nl = memchr(rp->rio_bufptr, '\n', cnt)) != NULL)
+	    cnt = nl - rp->rio_bufptr + 1;
+	memcpy(bufp, rp->rio_bufptr, cnt);
+	rp->rio_bufptr += cnt;
+	rp->rio_cnt -= cnt;
+	bufp += cnt;
+	n += cnt;
+	if (nl != NULL)
+	    break;
     }
     *bufp = 0;
-    return n-1;
+    return n;
 }
 /* $end rio_readlineb */
 
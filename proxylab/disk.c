@@ -0,0 +1,546 @@
+/*
+ * disk.c - Second-level cache on disk
+ *
+ * Objects evicted from memory and responses too big for it are kept as
+ * files under one directory, named by a 64-bit FNV-1a hash of their URL.
+ * Each file starts with a diskHdr and the URL, so the index can be read
+ * back from the directory at startup; files are recovered most recently
+ * used first by their mtime, which a hit touches. The header also keeps
+ * the time the object stops being fresh, as worked out when it was
+ * first stored, so hits do not make it younger.
+ *
+ * Evicted objects are copied onto a queue and written by one background
+ * thread, so eviction never waits for the disk. A response too big for
+ * memory is spooled by the thread relaying it, as it comes, into a
+ * temporary file. Either way the file is renamed into place only when
+ * complete, and the disk tier evicts its own LRU files to stay within
+ * its byte budget. Hits are sent with sendfile() straight from the file,
+ * and one small enough for memory is then read back into it.
+ */
+#include "proxy.h"
+#include <dirent.h>
+#include <sys/sendfile.h>
+
+#define DISK_BUCKETS 4096
+#define DISK_QUEUE 64			/* Evicted objects waiting to be written */
+#define DISK_MAGIC 0x32445850	/* "PXD2" */
+#define DISK_MAX_OBJECT (disk.budget / 4)
+
+/* At the start of every file, followed by the URL then the object */
+typedef struct {
+	unsigned int magic;
+	unsigned int urlLen;
+	unsigned long hdrLen;
+	unsigned long size;
+	long expires;
+} diskHdr;
+
+typedef struct diskEntry {
+	char *url;
+	unsigned long key;
+	off_t fileSize;
+	time_t mtime;				/* Only used to order the startup scan */
+	struct diskEntry *next;
+	struct diskEntry *lruPrev;
+	struct diskEntry *lruNext;
+} diskEntry;
+
+/* An evicted object, copied, waiting for the writer */
+typedef struct {
+	char *url;
+	char *obj;
+	size_t size;
+	size_t hdrLen;
+	time_t expires;
+} diskJob;
+
+/* A response being spooled to disk as it is relayed */
+struct diskFile {
+	int fd;
+	char tmp[MAXLINE];
+	char *url;
+	size_t hdrLen;
+	size_t size;				/* Object bytes the file will hold */
+	size_t len;					/* Object bytes written so far */
+};
+
+static struct {
+	char *dir;					/* NULL when the disk tier is off */
+	size_t budget;
+	size_t bytes;
+	int num;
+	diskEntry *bucket[DISK_BUCKETS];
+	diskEntry lru;				/* lruNext is the most recent */
+	pthread_mutex_t mutex;
+
+	diskJob *queue[DISK_QUEUE];
+	int head, cnt;
+	pthread_mutex_t qMutex;
+	pthread_cond_t qCond;
+} disk;
+
+static struct {
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long writes;		/* Evicted objects written */
+	unsigned long spools;		/* Large responses written */
+	unsigned long evictions;
+	unsigned long dropped;		/* Evicted objects not written, the queue was full */
+	unsigned long failures;
+} diskStat;
+
+void *diskWriter(void *vargp);
+
+/* Statistics are bumped outside disk.mutex */
+static void diskCount(unsigned long *c) {
+	__atomic_add_fetch(c, 1, __ATOMIC_RELAXED);
+}
+
+/* FNV-1a, 64 bits since it names the file */
+static unsigned long diskKey(char *url) {
+	unsigned long h = 14695981039346656037ul;
+
+	while(*url) {
+		h ^= (unsigned char)*url++;
+		h *= 1099511628211ul;
+	}
+	return h;
+}
+
+static void diskPath(char *path, unsigned long key) {
+	sprintf(path, "%s/%016lx", disk.dir, key);
+}
+
+/* Callers hold disk.mutex */
+static void diskLruUnlink(diskEntry *e) {
+	e->lruPrev->lruNext = e->lruNext;
+	e->lruNext->lruPrev = e->lruPrev;
+}
+
+static void diskLruPush(diskEntry *e) {
+	e->lruPrev = &disk.lru;
+	e->lruNext = disk.lru.lruNext;
+	disk.lru.lruNext->lruPrev = e;
+	disk.lru.lruNext = e;
+}
+
+static diskEntry *diskFind(char *url, unsigned long key) {
+	diskEntry *e;
+
+	for(e = disk.bucket[key % DISK_BUCKETS]; e != NULL; e = e->next)
+		if(e->key == key && strcmp(e->url, url) == 0) return e;
+	return NULL;
+}
+
+/* Takes e out of the index, leaving its file */
+static void diskRemove(diskEntry *e) {
+	diskEntry **pp = &disk.bucket[e->key % DISK_BUCKETS];
+
+	while(*pp != e) pp = &(*pp)->next;
+	*pp = e->next;
+	diskLruUnlink(e);
+	disk.bytes -= e->fileSize;
+	disk.num--;
+	Free(e->url);
+	Free(e);
+}
+
+static void diskAdd(diskEntry *e) {
+	int b = e->key % DISK_BUCKETS;
+
+	e->next = disk.bucket[b];
+	disk.bucket[b] = e;
+	diskLruPush(e);
+	disk.bytes += e->fileSize;
+	disk.num++;
+}
+
+/* Drops least recently used files until 'need' more bytes fit */
+static void diskMakeRoom(size_t need) {
+	char path[MAXLINE];
+	diskEntry *e;
+
+	while(disk.num > 0 && disk.bytes + need > disk.budget) {
+		e = disk.lru.lruPrev;
+		diskPath(path, e->key);
+		unlink(path);
+		diskRemove(e);
+		diskCount(&diskStat.evictions);
+	}
+}
+
+/*
+ * Renames a complete temporary file into place and indexes it, replacing
+ * any file of the same name. Files with another URL of the same key are
+ * simply overwritten.
+ */
+static void diskInstall(char *tmp, char *url, off_t fileSize) {
+	char path[MAXLINE];
+	unsigned long key = diskKey(url);
+	diskEntry *e, *old;
+
+	pthread_mutex_lock(&disk.mutex);
+	for(old = disk.bucket[key % DISK_BUCKETS]; old != NULL; old = old->next)
+		if(old->key == key) break;
+	if(old != NULL) diskRemove(old);
+	diskMakeRoom(fileSize);
+
+	diskPath(path, key);
+	if(rename(tmp, path) < 0) {
+		pthread_mutex_unlock(&disk.mutex);
+		unlink(tmp);
+		diskCount(&diskStat.failures);
+		return;
+	}
+
+	e = Malloc(sizeof(diskEntry));
+	e->url = Malloc(strlen(url) + 1);
+	strcpy(e->url, url);
+	e->key = key;
+	e->fileSize = fileSize;
+	diskAdd(e);
+	pthread_mutex_unlock(&disk.mutex);
+}
+
+/* Opens a temporary file in the directory with its diskHdr and URL written */
+static int diskCreate(char *tmp, char *url, size_t hdrLen, size_t size, time_t expires) {
+	diskHdr h;
+	int fd;
+
+	sprintf(tmp, "%s/.tmp.XXXXXX", disk.dir);
+	if((fd = mkstemp(tmp)) < 0) return -1;
+
+	h.magic = DISK_MAGIC;
+	h.urlLen = strlen(url);
+	h.hdrLen = hdrLen;
+	h.size = size;
+	h.expires = expires;
+	if(rio_writen(fd, (char *)&h, sizeof(h)) < 0 || rio_writen(fd, url, h.urlLen) < 0) {
+		close(fd);
+		unlink(tmp);
+		return -1;
+	}
+	return fd;
+}
+
+/* Reads back one file's diskHdr and URL, NULL if it is not a whole cache file */
+static diskEntry *diskLoad(char *name) {
+	char path[MAXLINE];
+	struct stat st;
+	diskHdr h;
+	diskEntry *e;
+	char *url;
+	ssize_t n;
+	int fd;
+
+	sprintf(path, "%s/%s", disk.dir, name);
+	if((fd = open(path, O_RDONLY)) < 0) return NULL;
+	if(fstat(fd, &st) < 0 || read(fd, &h, sizeof(h)) != sizeof(h) || h.magic != DISK_MAGIC ||
+			h.urlLen >= MAXLINE || st.st_size != sizeof(h) + h.urlLen + h.size) {
+		close(fd);
+		return NULL;
+	}
+
+	url = Malloc(h.urlLen + 1);
+	n = read(fd, url, h.urlLen);
+	close(fd);
+	url[h.urlLen] = '\0';
+	if(n != h.urlLen || diskKey(url) != strtoul(name, NULL, 16)) {
+		Free(url);
+		return NULL;
+	}
+
+	e = Malloc(sizeof(diskEntry));
+	e->url = url;
+	e->key = diskKey(url);
+	e->fileSize = st.st_size;
+	e->mtime = st.st_mtime;
+	return e;
+}
+
+static int diskOlder(const void *a, const void *b) {
+	time_t x = (*(diskEntry **)a)->mtime, y = (*(diskEntry **)b)->mtime;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Rebuilds the index from the directory, dropping leftover and broken files */
+static void diskScan() {
+	DIR *d;
+	struct dirent *de;
+	char path[MAXLINE];
+	diskEntry **list = NULL, *e;
+	int i, cnt = 0, cap = 0;
+
+	if((d = opendir(disk.dir)) == NULL) unix_error("opendir error");
+	while((de = readdir(d)) != NULL) {
+		if(strncmp(de->d_name, ".tmp.", 5) == 0) {
+			sprintf(path, "%s/%s", disk.dir, de->d_name);
+			unlink(path);
+			continue;
+		}
+		if(strlen(de->d_name) != 16 || strspn(de->d_name, "0123456789abcdef") != 16) continue;
+		if((e = diskLoad(de->d_name)) == NULL) {
+			sprintf(path, "%s/%s", disk.dir, de->d_name);
+			unlink(path);
+			continue;
+		}
+		if(cnt == cap) {
+			cap = cap ? cap * 2 : 256;
+			list = Realloc(list, cap * sizeof(diskEntry *));
+		}
+		list[cnt++] = e;
+	}
+	closedir(d);
+
+	/* Oldest first, so the most recent ends up at the front */
+	qsort(list, cnt, sizeof(diskEntry *), diskOlder);
+	for(i = 0; i < cnt; i++) diskAdd(list[i]);
+	Free(list);
+	diskMakeRoom(0);
+}
+
+/* Turns the disk tier on with 'budget' bytes under dir, creating it if needed */
+void diskInit(char *dir, size_t budget) {
+	pthread_t tid;
+
+	if(mkdir(dir, 0755) < 0 && errno != EEXIST) unix_error("mkdir error");
+	disk.dir = dir;
+	disk.budget = budget;
+	disk.lru.lruPrev = disk.lru.lruNext = &disk.lru;
+	pthread_mutex_init(&disk.mutex, NULL);
+	pthread_mutex_init(&disk.qMutex, NULL);
+	pthread_cond_init(&disk.qCond, NULL);
+	diskScan();
+	Pthread_create(&tid, NULL, diskWriter, NULL);
+}
+
+/*
+ * Queues a copy of an object for the writer unless the disk already has
+ * it. Never blocks on the disk: with the queue full the object is lost.
+ */
+void diskPut(char *url, char *obj, size_t size, size_t hdrLen, time_t expires) {
+	diskJob *j;
+	size_t urlLen = strlen(url) + 1;
+	int have;
+
+	if(disk.dir == NULL || sizeof(diskHdr) + urlLen + size > DISK_MAX_OBJECT) return;
+
+	pthread_mutex_lock(&disk.mutex);
+	have = diskFind(url, diskKey(url)) != NULL;
+	pthread_mutex_unlock(&disk.mutex);
+	if(have) return;
+
+	pthread_mutex_lock(&disk.qMutex);
+	if(disk.cnt == DISK_QUEUE) {
+		diskCount(&diskStat.dropped);
+		pthread_mutex_unlock(&disk.qMutex);
+		return;
+	}
+	j = Malloc(sizeof(diskJob) + urlLen + size);
+	j->url = (char *)(j + 1);
+	j->obj = j->url + urlLen;
+	memcpy(j->url, url, urlLen);
+	memcpy(j->obj, obj, size);
+	j->size = size;
+	j->hdrLen = hdrLen;
+	j->expires = expires;
+	disk.queue[(disk.head + disk.cnt++) % DISK_QUEUE] = j;
+	pthread_cond_signal(&disk.qCond);
+	pthread_mutex_unlock(&disk.qMutex);
+}
+
+void *diskWriter(void *vargp) {
+	char tmp[MAXLINE];
+	diskJob *j;
+	int fd;
+
+	Pthread_detach(pthread_self());
+	while(1) {
+		pthread_mutex_lock(&disk.qMutex);
+		while(disk.cnt == 0) pthread_cond_wait(&disk.qCond, &disk.qMutex);
+		j = disk.queue[disk.head];
+		disk.head = (disk.head + 1) % DISK_QUEUE;
+		disk.cnt--;
+		pthread_mutex_unlock(&disk.qMutex);
+
+		if((fd = diskCreate(tmp, j->url, j->hdrLen, j->size, j->expires)) < 0) diskCount(&diskStat.failures);
+		else if(rio_writen(fd, j->obj, j->size) < 0) {
+			close(fd);
+			unlink(tmp);
+			diskCount(&diskStat.failures);
+		}
+		else {
+			close(fd);
+			diskInstall(tmp, j->url, sizeof(diskHdr) + strlen(j->url) + j->size);
+			diskCount(&diskStat.writes);
+		}
+		Free(j);
+	}
+	return NULL;
+}
+
+/*
+ * Starts spooling a response whose body of bodyLen bytes is still to
+ * come. hdr holds its stored header lines, hdrLen bytes, without the
+ * empty line. NULL if the disk tier is off or the object is too big for
+ * it.
+ */
+diskFile *diskOpen(char *url, char *hdr, size_t hdrLen, long bodyLen, time_t expires) {
+	diskFile *d;
+	size_t size = hdrLen + 2 + bodyLen;
+
+	if(disk.dir == NULL || sizeof(diskHdr) + strlen(url) + size > DISK_MAX_OBJECT) return NULL;
+
+	d = Malloc(sizeof(diskFile));
+	if((d->fd = diskCreate(d->tmp, url, hdrLen, size, expires)) < 0 ||
+			rio_writen(d->fd, hdr, hdrLen) < 0 || rio_writen(d->fd, (char *)"\r\n", 2) < 0) {
+		if(d->fd >= 0) {
+			close(d->fd);
+			unlink(d->tmp);
+		}
+		diskCount(&diskStat.failures);
+		Free(d);
+		return NULL;
+	}
+	d->url = Malloc(strlen(url) + 1);
+	strcpy(d->url, url);
+	d->hdrLen = hdrLen;
+	d->size = size;
+	d->len = hdrLen + 2;
+	return d;
+}
+
+/* Appends body bytes, -1 once the file has been given up */
+int diskWrite(diskFile *d, char *buf, size_t n) {
+	if(d->fd < 0) return -1;
+	if(d->len + n > d->size || rio_writen(d->fd, buf, n) < 0) {
+		close(d->fd);
+		unlink(d->tmp);
+		d->fd = -1;
+		diskCount(&diskStat.failures);
+		return -1;
+	}
+	d->len += n;
+	return 0;
+}
+
+/* Installs the spooled file if ok and complete, otherwise discards it */
+void diskClose(diskFile *d, int ok) {
+	if(d->fd >= 0) {
+		close(d->fd);
+		if(ok && d->len == d->size) {
+			diskInstall(d->tmp, d->url, sizeof(diskHdr) + strlen(d->url) + d->size);
+			diskCount(&diskStat.spools);
+		}
+		else unlink(d->tmp);
+	}
+	Free(d->url);
+	Free(d);
+}
+
+/* Drops the file of url, found stale, so a fresh copy can take its place */
+static void diskDrop(char *url, unsigned long key) {
+	char path[MAXLINE];
+	diskEntry *e;
+
+	pthread_mutex_lock(&disk.mutex);
+	if((e = diskFind(url, key)) != NULL) {
+		diskPath(path, key);
+		unlink(path);
+		diskRemove(e);
+	}
+	pthread_mutex_unlock(&disk.mutex);
+}
+
+/*
+ * Sends the object stored for url with conn as its Connection header,
+ * the body by sendfile(). Returns 1 if sent, 0 if the disk does not have
+ * a fresh copy (nothing written), and -1 if the client could not be
+ * written.
+ */
+int diskServe(char *url, int connfd, const char *conn) {
+	char path[MAXLINE], name[MAXLINE], *hdr;
+	unsigned long key = diskKey(url);
+	diskEntry *e;
+	diskHdr h;
+	freshInfo fi;
+	off_t off;
+	size_t left;
+	ssize_t n;
+	int fd, rc = 1;
+
+	if(disk.dir == NULL) return 0;
+
+	pthread_mutex_lock(&disk.mutex);
+	if((e = diskFind(url, key)) == NULL) {
+		diskCount(&diskStat.misses);
+		pthread_mutex_unlock(&disk.mutex);
+		return 0;
+	}
+	diskLruUnlink(e);
+	diskLruPush(e);
+	diskPath(path, key);
+	pthread_mutex_unlock(&disk.mutex);
+
+	/* Evicted or replaced since, the open file stays readable either way */
+	if((fd = open(path, O_RDONLY)) < 0) return 0;
+	if(read(fd, &h, sizeof(h)) != sizeof(h) || h.magic != DISK_MAGIC || h.urlLen >= MAXLINE ||
+			read(fd, name, h.urlLen) != h.urlLen || (name[h.urlLen] = '\0', strcmp(name, url)) != 0) {
+		close(fd);
+		return 0;
+	}
+	hdr = Malloc(h.hdrLen);
+	if(read(fd, hdr, h.hdrLen) != h.hdrLen) {
+		Free(hdr);
+		close(fd);
+		return 0;
+	}
+
+	/* A stale copy goes, the fetch that follows brings a fresh one */
+	if(time(NULL) >= h.expires) {
+		Free(hdr);
+		close(fd);
+		diskDrop(url, key);
+		diskCount(&diskStat.misses);
+		return 0;
+	}
+	diskCount(&diskStat.hits);
+
+	if(rio_writen(connfd, hdr, h.hdrLen) < 0 || rio_writen(connfd, (char *)conn, strlen(conn)) < 0) rc = -1;
+	Free(hdr);
+
+	off = sizeof(h) + h.urlLen + h.hdrLen;
+	left = h.size - h.hdrLen;
+	while(rc > 0 && left > 0) {
+		if((n = sendfile(connfd, fd, &off, left)) < 0 && errno == EINTR) continue;
+		if(n <= 0) rc = -1;
+		else left -= n;
+	}
+
+	/* Its mtime orders the index rebuilt at the next start */
+	futimens(fd, NULL);
+
+	/* An object that fits memory goes back there, the disk keeps its copy */
+	if(h.size <= MAX_OBJECT_SIZE) {
+		hdr = Malloc(h.size);
+		if(pread(fd, hdr, h.size, sizeof(h) + h.urlLen) == h.size) {
+			freshParse(hdr, h.hdrLen, time(NULL), &fi);
+			freshExpire(&fi, h.expires);
+			cacheURI(url, cacheHash(url), hdr, h.size, h.hdrLen, &fi);
+		}
+		Free(hdr);
+	}
+	close(fd);
+	return rc;
+}
+
+void diskStats(FILE *fp) {
+	if(disk.dir == NULL) return;
+	pthread_mutex_lock(&disk.mutex);
+	fprintf(fp, "disk %s files %d bytes %lu/%lu hits %lu misses %lu writes %lu spools %lu evictions %lu dropped %lu failures %lu\n",
+			disk.dir, disk.num, (unsigned long)disk.bytes, (unsigned long)disk.budget, diskStat.hits, diskStat.misses,
+			diskStat.writes, diskStat.spools, diskStat.evictions, diskStat.dropped, diskStat.failures);
+	pthread_mutex_unlock(&disk.mutex);
+	fflush(fp);
+}
@@ -0,0 +1,208 @@
+/*
+ * dns.c - Resolver cache in front of getaddrinfo
+ *
+ * Results are kept per host:port for DNS_TTL seconds, and failures for
+ * DNS_NEG_TTL seconds. getaddrinfo reports no record TTLs, so these are
+ * fixed. A lookup that finds another thread already resolving the same
+ * name waits for that result instead of asking again. Callers get their
+ * own copy of the address list and free it with dnsFree.
+ *
+ * At most DNS_MAX_ENTRIES names are kept. A new name past that drops the
+ * expired ones, or failing any the one closest to expiry, so clients
+ * asking for many hosts cannot grow the table without bound.
+ */
+#include "proxy.h"
+
+#define DNS_BUCKETS 256
+#define DNS_TTL 60			/* Seconds */
+#define DNS_NEG_TTL 5
+#define DNS_MAX_ENTRIES 1024
+
+typedef struct dnsEntry {
+	char *key;				/* host:port */
+	struct addrinfo *addrs;
+	int err;				/* getaddrinfo error, 0 if resolved */
+	time_t expires;
+	int pending;			/* Being resolved */
+	int waiters;			/* Threads waiting for it, it stays until they go */
+	struct dnsEntry *next;
+} dnsEntry;
+
+static dnsEntry *dnsTable[DNS_BUCKETS];
+static int dnsCnt;
+static pthread_mutex_t dnsMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dnsDone = PTHREAD_COND_INITIALIZER;
+
+static struct {
+	unsigned long lookups;
+	unsigned long hits;
+	unsigned long negHits;	/* Hits on a cached failure */
+	unsigned long waits;	/* Lookups that joined one in flight */
+	unsigned long resolves;	/* Calls to getaddrinfo */
+	unsigned long failures;
+	unsigned long evictions;
+	double resolveUsec;		/* Total time in getaddrinfo */
+	double maxUsec;
+} dnsStat;
+
+/* Copies a list into one allocation per node, without canonical names */
+static struct addrinfo *addrCopy(struct addrinfo *list) {
+	struct addrinfo *head = NULL, **tail = &head, *a;
+
+	for(; list != NULL; list = list->ai_next) {
+		a = Malloc(sizeof(struct addrinfo) + list->ai_addrlen);
+		*a = *list;
+		a->ai_addr = (struct sockaddr *)(a + 1);
+		memcpy(a->ai_addr, list->ai_addr, list->ai_addrlen);
+		a->ai_canonname = NULL;
+		a->ai_next = NULL;
+		*tail = a;
+		tail = &a->ai_next;
+	}
+	return head;
+}
+
+void dnsFree(struct addrinfo *list) {
+	struct addrinfo *next;
+
+	for(; list != NULL; list = next) {
+		next = list->ai_next;
+		Free(list);
+	}
+}
+
+/* Whether e can be dropped, callers hold dnsMutex */
+static int dnsIdle(dnsEntry *e) {
+	return !e->pending && e->waiters == 0;
+}
+
+static void dnsRemove(dnsEntry **p) {
+	dnsEntry *e = *p;
+
+	*p = e->next;
+	if(e->addrs != NULL) freeaddrinfo(e->addrs);
+	Free(e->key);
+	Free(e);
+	dnsCnt--;
+	dnsStat.evictions++;
+}
+
+/* Makes room for one more entry : drops the expired, or else the one expiring first */
+static void dnsEvict() {
+	dnsEntry **p, **oldest = NULL;
+	time_t now = time(NULL);
+	int i;
+
+	for(i = 0; i < DNS_BUCKETS; i++) {
+		p = &dnsTable[i];
+		while(*p != NULL) {
+			if(dnsIdle(*p) && now >= (*p)->expires) dnsRemove(p);
+			else p = &(*p)->next;
+		}
+	}
+	if(dnsCnt < DNS_MAX_ENTRIES) return;
+
+	for(i = 0; i < DNS_BUCKETS; i++) {
+		for(p = &dnsTable[i]; *p != NULL; p = &(*p)->next) {
+			if(dnsIdle(*p) && (oldest == NULL || (*p)->expires < (*oldest)->expires)) oldest = p;
+		}
+	}
+	if(oldest != NULL) dnsRemove(oldest);
+}
+
+/* Resolves host:port like open_clientfd, returns 0 or a getaddrinfo error */
+int dnsLookup(char *host, char *port, struct addrinfo **res) {
+	char key[MAXLINE];
+	dnsEntry **b, *e;
+	struct addrinfo hints, *list;
+	struct timeval t0, t1;
+	double usec;
+	int rc;
+
+	snprintf(key, MAXLINE, "%s:%s", host, port);
+	b = &dnsTable[cacheHash(key) % DNS_BUCKETS];
+
+	pthread_mutex_lock(&dnsMutex);
+	dnsStat.lookups++;
+	for(e = *b; e != NULL; e = e->next) {
+		if(strcmp(e->key, key) == 0) break;
+	}
+	if(e != NULL && e->pending) {
+		dnsStat.waits++;
+		e->waiters++;
+		while(e->pending) pthread_cond_wait(&dnsDone, &dnsMutex);
+		e->waiters--;
+	}
+	if(e != NULL && time(NULL) < e->expires) {
+		if(e->err) dnsStat.negHits++;
+		else dnsStat.hits++;
+		rc = e->err;
+		*res = rc ? NULL : addrCopy(e->addrs);
+		pthread_mutex_unlock(&dnsMutex);
+		return rc;
+	}
+	if(e == NULL) {
+		if(dnsCnt >= DNS_MAX_ENTRIES) dnsEvict();
+		dnsCnt++;
+		e = Calloc(1, sizeof(dnsEntry));
+		e->key = Malloc(strlen(key) + 1);
+		strcpy(e->key, key);
+		e->next = *b;
+		*b = e;
+	}
+	e->pending = 1;
+	dnsStat.resolves++;
+	pthread_mutex_unlock(&dnsMutex);
+
+	memset(&hints, 0, sizeof(struct addrinfo));
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_NUMERICSERV | AI_ADDRCONFIG;
+	gettimeofday(&t0, NULL);
+	rc = getaddrinfo(host, port, &hints, &list);
+	gettimeofday(&t1, NULL);
+	usec = (t1.tv_sec - t0.tv_sec) * 1e6 + (t1.tv_usec - t0.tv_usec);
+
+	pthread_mutex_lock(&dnsMutex);
+	if(e->addrs != NULL) freeaddrinfo(e->addrs);
+	e->addrs = rc ? NULL : list;
+	e->err = rc;
+	e->expires = time(NULL) + (rc ? DNS_NEG_TTL : DNS_TTL);
+	e->pending = 0;
+	dnsStat.resolveUsec += usec;
+	if(usec > dnsStat.maxUsec) dnsStat.maxUsec = usec;
+	if(rc) dnsStat.failures++;
+	*res = rc ? NULL : addrCopy(e->addrs);
+	pthread_cond_broadcast(&dnsDone);
+	pthread_mutex_unlock(&dnsMutex);
+
+	return rc;
+}
+
+/* open_clientfd with the address list from the cache */
+int dnsConnect(char *host, char *port) {
+	struct addrinfo *list, *p;
+	int fd = -1;
+
+	if(dnsLookup(host, port, &list) != 0) return -2;
+
+	for(p = list; p != NULL; p = p->ai_next) {
+		if((fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0) continue;
+		if(connect(fd, p->ai_addr, p->ai_addrlen) == 0) break;
+		close(fd);
+		fd = -1;
+	}
+
+	dnsFree(list);
+	return fd;
+}
+
+void dnsStats(FILE *fp) {
+	pthread_mutex_lock(&dnsMutex);
+	fprintf(fp, "dns names %d/%d lookups %lu hits %lu (%.1f%%) negative hits %lu waits %lu resolves %lu failures %lu evictions %lu",
+			dnsCnt, DNS_MAX_ENTRIES, dnsStat.lookups, dnsStat.hits, dnsStat.lookups ? 100.0 * dnsStat.hits / dnsStat.lookups : 0.0,
+			dnsStat.negHits, dnsStat.waits, dnsStat.resolves, dnsStat.failures, dnsStat.evictions);
+	fprintf(fp, " resolve avg %.0f us max %.0f us\n",
+			dnsStat.resolves ? dnsStat.resolveUsec / dnsStat.resolves : 0.0, dnsStat.maxUsec);
+	pthread_mutex_unlock(&dnsMutex);
+	fflush(fp);
+}
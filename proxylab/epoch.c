@@ -0,0 +1,125 @@
+/*
+ * epoch.c - Epoch-based reclamation
+ *
+ * Readers bracket lock-free traversals with epochEnter/epochExit, which
+ * only store to the calling thread's own slot. Memory unlinked by a
+ * writer is retired with the global epoch of the moment, and freed once
+ * the epoch has moved two steps past it: by then every reader that could
+ * have seen it has left. The epoch moves only when every active reader
+ * has observed the current one.
+ *
+ * The slots and the retired list are shared by the worker processes
+ * (see shm.c). Each slot records the process that claimed it, so a
+ * worker that died inside an epoch does not hold the epoch back, and its
+ * slots are taken over by later threads.
+ */
+#include "proxy.h"
+
+#define EPOCH_SLOTS 1024	/* Threads that may read */
+
+typedef struct {
+	unsigned long state;	/* (epoch << 1) | 1 while reading, 0 outside */
+	pid_t pid;				/* Owner, 0 if unclaimed */
+	char pad[64 - sizeof(unsigned long) - sizeof(pid_t)];	/* One cache line per thread */
+} epochSlot;
+
+typedef struct {
+	epochSlot slots[EPOCH_SLOTS];
+	int slotCnt;			/* Slots ever claimed */
+	unsigned long globalEpoch;
+	epochNode *retiredList;
+	pthread_mutex_t retireMutex;
+} epochState;
+
+static epochState *ep;
+static __thread int mySlot = -1;
+
+void epochInit() {
+	ep = shmMap(sizeof(epochState), 64);
+	ep->globalEpoch = 1;
+	shmMutexInit(&ep->retireMutex);
+}
+
+/* Takes a slot no live process owns */
+static int epochClaim() {
+	pid_t me = getpid(), owner;
+	int i, n;
+
+	for(i = 0; i < EPOCH_SLOTS; i++) {
+		owner = __atomic_load_n(&ep->slots[i].pid, __ATOMIC_RELAXED);
+		if(owner != 0 && (owner == me || !shmDead(owner))) continue;
+		if(!__atomic_compare_exchange_n(&ep->slots[i].pid, &owner, me, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) continue;
+
+		__atomic_store_n(&ep->slots[i].state, 0, __ATOMIC_RELEASE);
+		n = __atomic_load_n(&ep->slotCnt, __ATOMIC_RELAXED);
+		while(n <= i && !__atomic_compare_exchange_n(&ep->slotCnt, &n, i + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+		return i;
+	}
+	app_error("epochEnter: too many threads");
+	return -1;
+}
+
+void epochEnter() {
+	unsigned long e;
+
+	if(mySlot < 0) mySlot = epochClaim();
+	e = __atomic_load_n(&ep->globalEpoch, __ATOMIC_RELAXED);
+	__atomic_store_n(&ep->slots[mySlot].state, e << 1 | 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void epochExit() {
+	__atomic_store_n(&ep->slots[mySlot].state, 0, __ATOMIC_RELEASE);
+}
+
+/* fn(p) runs once no reader can still hold p, n is a link kept inside p */
+void epochRetire(epochNode *n, void *p, void (*fn)(void *)) {
+	n->p = p;
+	n->fn = fn;
+	n->epoch = __atomic_load_n(&ep->globalEpoch, __ATOMIC_SEQ_CST);
+
+	/* One store links it, so a holder's death leaves the list whole */
+	shmLock(&ep->retireMutex);
+	n->next = ep->retiredList;
+	ep->retiredList = n;
+	shmUnlock(&ep->retireMutex);
+}
+
+/* Advances the epoch if every reader has caught up, then frees what is safe */
+void epochReclaim() {
+	unsigned long g, s;
+	epochNode **p, *r, *done = NULL;
+	int i, n;
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	g = __atomic_load_n(&ep->globalEpoch, __ATOMIC_SEQ_CST);
+	n = __atomic_load_n(&ep->slotCnt, __ATOMIC_RELAXED);
+	for(i = 0; i < n; i++) {
+		s = __atomic_load_n(&ep->slots[i].state, __ATOMIC_ACQUIRE);
+		if(!(s & 1) || (s >> 1) == g) continue;
+
+		/* A reader that died in its epoch never leaves it */
+		if(!shmDead(__atomic_load_n(&ep->slots[i].pid, __ATOMIC_RELAXED))) break;
+		__atomic_compare_exchange_n(&ep->slots[i].state, &s, 0, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+	}
+	if(i == n) {
+		if(__atomic_compare_exchange_n(&ep->globalEpoch, &g, g + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) g++;
+	}
+
+	shmLock(&ep->retireMutex);
+	p = &ep->retiredList;
+	while((r = *p) != NULL) {
+		if(r->epoch + 2 <= g) {
+			*p = r->next;
+			r->next = done;
+			done = r;
+		}
+		else p = &r->next;
+	}
+	shmUnlock(&ep->retireMutex);
+
+	while((r = done) != NULL) {
+		done = r->next;
+		r->fn(r->p);
+	}
+}
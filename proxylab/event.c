@@ -0,0 +1,440 @@
+/*
+ * event.c - Event-driven connection engine
+ *
+ * Each loop thread owns an epoll instance and accepts from the shared
+ * non-blocking listening socket. Every connection is a state machine
+ * driven by readiness events, so one loop serves many clients:
+ *
+ *   REQUEST -> HIT                       (cache hit, or an error reply)
+ *   REQUEST -> CONNECT -> SEND -> RELAY  (cache miss, filled on EOF)
+ *
+ * The method goes upstream as the client sent it. A GET or HEAD hit is
+ * answered like in threaded mode: 304 for a conditional the entry
+ * satisfies, headers only for a HEAD. Only a GET fills the cache, and
+ * only with a 200. Request bodies are not relayed, so a request
+ * with one is answered 501.
+ *
+ * A closed connection is freed after the current batch of events,
+ * because the batch may still hold events for its descriptors.
+ */
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include "proxy.h"
+
+#define EV_MAXEVENTS 256
+
+/* Every connection closes after its response */
+static const char *close_hdr = "Connection: close\r\n";
+
+enum { ST_REQUEST, ST_CONNECT, ST_SEND, ST_RELAY, ST_HIT, ST_CLOSED };
+
+typedef struct conn conn_t;
+
+typedef struct {
+	int fd;
+	conn_t *c;			/* NULL for the listening socket */
+} evfd_t;
+
+struct conn {
+	int state;
+	int epfd;
+	evfd_t client;
+	evfd_t server;
+	char buf[MAXBUF];	/* Request head, then relay buffer */
+	size_t bufLen, bufOff;
+	char *out;			/* Upstream request or cached object */
+	size_t outLen, outOff;
+	char *url;
+	unsigned int hash;
+	char *obj;			/* Cache fill */
+	size_t objLen, objCap;
+	int cacheable;
+	struct addrinfo *addrs, *addr;	/* Upstream addresses to try */
+	conn_t *nextDead;
+};
+
+typedef struct {
+	int epfd;
+	evfd_t listen;
+	conn_t *dead;		/* Closed in this batch */
+} loop_t;
+
+static void setNonblock(int fd) {
+	int flags = fcntl(fd, F_GETFL, 0);
+
+	fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static void evCtl(conn_t *c, int op, evfd_t *e, unsigned int events) {
+	struct epoll_event ev;
+
+	ev.events = events;
+	ev.data.ptr = e;
+	epoll_ctl(c->epfd, op, e->fd, &ev);
+}
+
+static void connClose(loop_t *lp, conn_t *c) {
+	if(c->state == ST_CLOSED) return;
+
+	close(c->client.fd);
+	if(c->server.fd >= 0) close(c->server.fd);
+	c->state = ST_CLOSED;
+	c->nextDead = lp->dead;
+	lp->dead = c;
+}
+
+static void connFree(conn_t *c) {
+	if(c->addrs) dnsFree(c->addrs);
+	Free(c->out);
+	Free(c->url);
+	Free(c->obj);
+	Free(c);
+}
+
+/* Writes until done or EAGAIN, returns 1 if done, 0 if pending, -1 on error */
+static int writeSome(int fd, char *data, size_t len, size_t *off) {
+	ssize_t n;
+
+	while(*off < len) {
+		if((n = write(fd, data + *off, len - *off)) < 0) {
+			if(errno == EINTR) continue;
+			if(errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+			return -1;
+		}
+		*off += n;
+	}
+	return 1;
+}
+
+static void onAccept(loop_t *lp) {
+	int fd;
+	conn_t *c;
+
+	while(1) {
+		if((fd = accept(lp->listen.fd, NULL, NULL)) < 0) {
+			if(errno == EINTR) continue;
+			return;		/* Drained (EAGAIN), or out of descriptors for now */
+		}
+		setNonblock(fd);
+
+		c = Calloc(1, sizeof(conn_t));
+		c->state = ST_REQUEST;
+		c->epfd = lp->epfd;
+		c->client.fd = fd;
+		c->client.c = c;
+		c->server.fd = -1;
+		c->server.c = c;
+		evCtl(c, EPOLL_CTL_ADD, &c->client, EPOLLIN);
+	}
+}
+
+/* Connects to the next address that does not fail at once, returns -1 if none is left */
+static int startConnect(conn_t *c) {
+	int fd;
+
+	for(; c->addr; c->addr = c->addr->ai_next) {
+		if((fd = socket(c->addr->ai_family, c->addr->ai_socktype, c->addr->ai_protocol)) < 0) continue;
+		setNonblock(fd);
+		if(connect(fd, c->addr->ai_addr, c->addr->ai_addrlen) == 0 || errno == EINPROGRESS) {
+			c->server.fd = fd;
+			evCtl(c, EPOLL_CTL_ADD, &c->server, EPOLLOUT);
+			return 0;
+		}
+		close(fd);
+	}
+	return -1;
+}
+
+/* Answers with an empty response of status, then closes */
+static void replyError(conn_t *c, const char *status) {
+	c->out = Malloc(MAXLINE);
+	c->outLen = sprintf(c->out, "HTTP/1.1 %s\r\n%sContent-Length: 0\r\n\r\n", status, close_hdr);
+	c->state = ST_HIT;
+	evCtl(c, EPOLL_CTL_MOD, &c->client, EPOLLOUT);
+}
+
+static void onRequest(loop_t *lp, conn_t *c) {
+	char method[MAXLINE], uri[MAXLINE], version[MAXLINE], hdr[MAXLINE];
+	char hostName[MAXLINE], path[MAXLINE], portStr[100], hostHdr[MAXLINE], etcHdr[MAXLINE], httpHdr[REQUEST_HDR_SIZE];
+	char *line, *end, *num, *v;
+	int port, rc, hasBody = 0, body;
+	cacheEntry *entry = NULL;
+	condReq cond;
+	ssize_t n;
+	long len;
+
+	if((n = read(c->client.fd, c->buf + c->bufLen, sizeof(c->buf) - 1 - c->bufLen)) < 0) {
+		if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) return;
+	}
+	if(n <= 0) {
+		connClose(lp, c);
+		return;
+	}
+	c->bufLen += n;
+	c->buf[c->bufLen] = '\0';
+
+	if((end = strstr(c->buf, "\r\n\r\n")) == NULL) {
+		if(c->bufLen == sizeof(c->buf) - 1) replyError(c, "431 Request Header Fields Too Large");
+		return;
+	}
+
+	if(sscanf(c->buf, "%s %s %s", method, uri, version) != 3) {
+		connClose(lp, c);
+		return;
+	}
+	c->url = Malloc(strlen(uri) + 1);
+	strcpy(c->url, uri);
+
+	/* Request headers, one line at a time */
+	hostHdr[0] = '\0';
+	etcHdr[0] = '\0';
+	condInit(&cond, method);
+	line = strstr(c->buf, "\r\n") + 2;
+	while((end = strstr(line, "\r\n")) != NULL) {
+		n = end + 2 - line;
+		memcpy(hdr, line, n);
+		hdr[n] = '\0';
+		condParse(hdr, &cond);
+		if(isHdr(hdr, "Transfer-Encoding")) hasBody = 1;
+		else if(isHdr(hdr, "Content-Length")) {
+			num = strchr(hdr, ':') + 1;
+			len = strtol(num, &v, 10);
+			if(v == num || len < 0 || v[strspn(v, " \t\r\n")] != '\0') {
+				replyError(c, "400 Bad Request");
+				return;
+			}
+			if(len > 0) hasBody = 1;
+		}
+		if((rc = filterHdr(hdr, hostHdr, etcHdr)) < 0) {
+			replyError(c, "431 Request Header Fields Too Large");
+			return;
+		}
+		if(rc) break;
+		line = end + 2;
+	}
+	if(hasBody) {
+		replyError(c, "501 Not Implemented");
+		return;
+	}
+
+	/* A GET or HEAD is served from the cache, a stale hit is fetched again like a miss */
+	c->hash = cacheHash(c->url);
+	if((cond.head || strcasecmp(method, "GET") == 0) && (entry = cacheFind(c->url, c->hash)) != NULL && !cacheFresh(entry)) {
+		cacheRelease(entry);
+		entry = NULL;
+	}
+	if(entry != NULL) {
+		c->out = Malloc(entry->size + MAXLINE);
+		c->outLen = hitHdr(entry, close_hdr, &cond, c->out, &body);
+		if(body) {
+			memcpy(c->out + c->outLen, entry->obj + entry->hdrLen, entry->size - entry->hdrLen);
+			c->outLen += entry->size - entry->hdrLen;
+		}
+		cacheRelease(entry);
+		c->state = ST_HIT;
+		evCtl(c, EPOLL_CTL_MOD, &c->client, EPOLLOUT);
+		return;
+	}
+
+	/* A 304 or 206 the origin answers is left out by cacheResponse, which keeps only 200s */
+	c->cacheable = strcasecmp(method, "GET") == 0;
+	parseURI(uri, hostName, path, &port);
+	if(finishHttpHdr(httpHdr, method, hostName, path, hostHdr, etcHdr, 0) < 0) {
+		replyError(c, "431 Request Header Fields Too Large");
+		return;
+	}
+	c->outLen = strlen(httpHdr);
+	c->out = Malloc(c->outLen);
+	memcpy(c->out, httpHdr, c->outLen);
+
+	/* Blocks the loop only when the name is not cached */
+	sprintf(portStr, "%d", port);
+	if((rc = dnsLookup(hostName, portStr, &c->addrs)) != 0) {
+		c->addrs = NULL;
+		connClose(lp, c);
+		return;
+	}
+	c->addr = c->addrs;
+
+	evCtl(c, EPOLL_CTL_MOD, &c->client, 0);
+	c->state = ST_CONNECT;
+	if(startConnect(c) < 0) connClose(lp, c);
+}
+
+static void onSend(loop_t *lp, conn_t *c) {
+	int rc;
+
+	if((rc = writeSome(c->server.fd, c->out, c->outLen, &c->outOff)) < 0) connClose(lp, c);
+	if(rc <= 0) return;
+
+	Free(c->out);
+	c->out = NULL;
+	c->state = ST_RELAY;
+	c->bufLen = c->bufOff = 0;
+	evCtl(c, EPOLL_CTL_MOD, &c->server, EPOLLIN);
+}
+
+static void onConnect(loop_t *lp, conn_t *c) {
+	int err = 0;
+	socklen_t len = sizeof(err);
+
+	getsockopt(c->server.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+
+	/* Failed, try the next address */
+	if(err) {
+		close(c->server.fd);
+		c->server.fd = -1;
+		c->addr = c->addr->ai_next;
+		if(startConnect(c) < 0) connClose(lp, c);
+		return;
+	}
+
+	dnsFree(c->addrs);
+	c->addrs = c->addr = NULL;
+	c->state = ST_SEND;
+	onSend(lp, c);
+}
+
+static void onServerRead(loop_t *lp, conn_t *c) {
+	ssize_t n;
+	int rc;
+
+	if((n = read(c->server.fd, c->buf, sizeof(c->buf))) < 0) {
+		if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) return;
+		connClose(lp, c);
+		return;
+	}
+
+	/* End of the response */
+	if(n == 0) {
+		if(c->cacheable && c->objLen > 0) {
+			cacheResponse(c->url, c->hash, c->obj, c->objLen);
+		}
+		connClose(lp, c);
+		return;
+	}
+
+	if(c->cacheable) {
+		if(c->objLen + n > MAX_OBJECT_SIZE) {
+			c->cacheable = 0;
+			Free(c->obj);
+			c->obj = NULL;
+		}
+		else {
+			if(c->objLen + n + 1 > c->objCap) {
+				c->objCap = c->objCap ? c->objCap * 2 : MAXBUF;
+				if(c->objCap > MAX_OBJECT_SIZE) c->objCap = MAX_OBJECT_SIZE;
+				c->obj = Realloc(c->obj, c->objCap);
+			}
+			memcpy(c->obj + c->objLen, c->buf, n);
+			c->objLen += n;
+		}
+	}
+
+	c->bufLen = n;
+	c->bufOff = 0;
+	if((rc = writeSome(c->client.fd, c->buf, c->bufLen, &c->bufOff)) < 0) connClose(lp, c);
+
+	/* Client is slow, stop reading until the buffer is written */
+	else if(rc == 0) {
+		evCtl(c, EPOLL_CTL_MOD, &c->server, 0);
+		evCtl(c, EPOLL_CTL_MOD, &c->client, EPOLLOUT);
+	}
+}
+
+static void onClientWrite(loop_t *lp, conn_t *c) {
+	int rc;
+
+	if(c->state == ST_HIT) {
+		if((rc = writeSome(c->client.fd, c->out, c->outLen, &c->outOff)) != 0) connClose(lp, c);
+		return;
+	}
+
+	if((rc = writeSome(c->client.fd, c->buf, c->bufLen, &c->bufOff)) < 0) connClose(lp, c);
+	else if(rc == 1) {
+		evCtl(c, EPOLL_CTL_MOD, &c->client, 0);
+		evCtl(c, EPOLL_CTL_MOD, &c->server, EPOLLIN);
+	}
+}
+
+static void dispatch(loop_t *lp, evfd_t *e, unsigned int events) {
+	conn_t *c = e->c;
+
+	if(c == NULL) {
+		onAccept(lp);
+		return;
+	}
+	if(c->state == ST_CLOSED) return;
+
+	if(e == &c->client) {
+		if(events & (EPOLLERR | EPOLLHUP)) connClose(lp, c);
+		else if(c->state == ST_REQUEST) onRequest(lp, c);
+		else onClientWrite(lp, c);
+		return;
+	}
+
+	switch(c->state) {
+	case ST_CONNECT:
+		onConnect(lp, c);
+		break;
+	case ST_SEND:
+		if(events & EPOLLERR) connClose(lp, c);
+		else onSend(lp, c);
+		break;
+	case ST_RELAY:
+		onServerRead(lp, c);
+		break;
+	}
+}
+
+static void *loop(void *vargp) {
+	struct epoll_event events[EV_MAXEVENTS], ev;
+	loop_t lp;
+	conn_t *c;
+	int i, n;
+
+	lp.listen.fd = (int)(long)vargp;
+	lp.listen.c = NULL;
+	lp.dead = NULL;
+	if((lp.epfd = epoll_create1(0)) < 0) unix_error("epoll_create1 error");
+
+	ev.events = EPOLLIN;
+#ifdef EPOLLEXCLUSIVE
+	ev.events |= EPOLLEXCLUSIVE;	/* Wake one loop per connection */
+#endif
+	ev.data.ptr = &lp.listen;
+	if(epoll_ctl(lp.epfd, EPOLL_CTL_ADD, lp.listen.fd, &ev) < 0) unix_error("epoll_ctl error");
+
+	while(1) {
+		if((n = epoll_wait(lp.epfd, events, EV_MAXEVENTS, -1)) < 0) {
+			if(errno == EINTR) continue;
+			unix_error("epoll_wait error");
+		}
+
+		for(i = 0; i < n; i++) dispatch(&lp, events[i].data.ptr, events[i].events);
+
+		while((c = lp.dead) != NULL) {
+			lp.dead = c->nextDead;
+			connFree(c);
+		}
+	}
+
+	return NULL;
+}
+
+void eventLoops(int listenfd, int nloops) {
+	struct rlimit rl;
+	pthread_t tid;
+	int i;
+
+	/* Two descriptors per connection */
+	if(getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+
+	setNonblock(listenfd);
+
+	for(i = 1; i < nloops; i++) Pthread_create(&tid, NULL, loop, (void *)(long)listenfd);
+	loop((void *)(long)listenfd);
+}
@@ -0,0 +1,167 @@
+/*
+ * flight.c - One upstream fetch per URL at a time
+ *
+ * The first miss for a URL leads a flight and fills its buffer with the
+ * raw response; misses for the same URL while it is in flight follow it.
+ * When the response has a Content-Length that fits the buffer, followers
+ * tail it: they write the leader's filtered headers and then the body as
+ * it is published. Otherwise they wait for the leader to finish and look
+ * in the cache again. The leader ends a flight, unlinking it so later
+ * misses lead their own; the last thread to release it frees it.
+ *
+ * A follower waits FLIGHT_WAIT seconds at most for the leader to move
+ * on, so a hung origin does not hold every coalesced client: before the
+ * body it gives up and fetches for itself, while tailing it breaks off.
+ */
+#include "proxy.h"
+
+#define FLIGHT_BUCKETS 1024
+#define FLIGHT_WAIT 10			/* Seconds */
+
+static flight *flights[FLIGHT_BUCKETS];
+static pthread_mutex_t flightMutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Joins the flight for url, creating it if none is in the air, sets *leader */
+flight *flightJoin(char *url, unsigned int hash, int *leader) {
+	flight **b = &flights[hash % FLIGHT_BUCKETS], *f;
+
+	pthread_mutex_lock(&flightMutex);
+	for(f = *b; f != NULL; f = f->next) {
+		if(f->hash == hash && strcmp(f->url, url) == 0) break;
+	}
+	if(f != NULL) {
+		f->refs++;
+		*leader = 0;
+		pthread_mutex_unlock(&flightMutex);
+		return f;
+	}
+
+	f = Calloc(1, sizeof(flight));
+	f->url = Malloc(strlen(url) + 1);
+	strcpy(f->url, url);
+	f->hash = hash;
+	f->buf = Malloc(MAX_OBJECT_SIZE);
+	f->contentLen = -1;
+	f->state = FL_HEAD;
+	f->refs = 1;
+	pthread_cond_init(&f->cond, NULL);
+	f->next = *b;
+	*b = f;
+	*leader = 1;
+	pthread_mutex_unlock(&flightMutex);
+	return f;
+}
+
+/*
+ * Leader : the response headers are in. hdr, without a Connection header,
+ * lets followers tail a body of contentLen bytes; NULL makes them wait.
+ */
+void flightHead(flight *f, char *hdr, size_t hdrLen, long contentLen) {
+	pthread_mutex_lock(&flightMutex);
+	if(hdr != NULL) {
+		f->hdr = Malloc(hdrLen);
+		memcpy(f->hdr, hdr, hdrLen);
+		f->hdrLen = hdrLen;
+		f->bodyOff = f->len;
+		f->contentLen = contentLen;
+		f->state = FL_TAIL;
+	}
+	else f->state = FL_WAIT;
+	pthread_cond_broadcast(&f->cond);
+	pthread_mutex_unlock(&flightMutex);
+}
+
+/* Leader : the first len bytes of buf are final */
+void flightPublish(flight *f, size_t len) {
+	pthread_mutex_lock(&flightMutex);
+	f->len = len;
+	if(f->state == FL_TAIL) pthread_cond_broadcast(&f->cond);
+	pthread_mutex_unlock(&flightMutex);
+}
+
+/* Leader : done, or failed unless ok, once per flight */
+void flightEnd(flight *f, int ok) {
+	flight **p;
+
+	pthread_mutex_lock(&flightMutex);
+	if(f->state != FL_DONE && f->state != FL_FAILED) {
+		f->state = ok ? FL_DONE : FL_FAILED;
+		for(p = &flights[f->hash % FLIGHT_BUCKETS]; *p != NULL; p = &(*p)->next) {
+			if(*p == f) {
+				*p = f->next;
+				break;
+			}
+		}
+		pthread_cond_broadcast(&f->cond);
+	}
+	pthread_mutex_unlock(&flightMutex);
+}
+
+void flightRelease(flight *f) {
+	int last;
+
+	pthread_mutex_lock(&flightMutex);
+	last = --f->refs == 0;
+	pthread_mutex_unlock(&flightMutex);
+
+	if(last) {
+		pthread_cond_destroy(&f->cond);
+		Free(f->hdr);
+		Free(f->buf);
+		Free(f->url);
+		Free(f);
+	}
+}
+
+/* Waits on the flight's condition until woken or FLIGHT_WAIT seconds have passed, 0 on timeout */
+static int flightWait(flight *f) {
+	struct timespec deadline;
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += FLIGHT_WAIT;
+	return pthread_cond_timedwait(&f->cond, &flightMutex, &deadline) != ETIMEDOUT;
+}
+
+/*
+ * Follower : serves the leader's response with conn as its Connection
+ * header. Returns 1 once served, 0 if it broke off after writing, and -1
+ * with nothing written when the response cannot be tailed or the leader
+ * is too slow to start it.
+ */
+int flightFollow(flight *f, int connfd, const char *conn) {
+	size_t sent = 0, avail;
+	int state;
+
+	pthread_mutex_lock(&flightMutex);
+	while(f->state == FL_HEAD) {
+		if(!flightWait(f) && f->state == FL_HEAD) {
+			pthread_mutex_unlock(&flightMutex);
+			return -1;
+		}
+	}
+	if(f->hdr == NULL) {
+		while(f->state == FL_WAIT && flightWait(f));
+		pthread_mutex_unlock(&flightMutex);
+		return -1;
+	}
+	pthread_mutex_unlock(&flightMutex);
+
+	if(rio_writen(connfd, f->hdr, f->hdrLen) < 0 ||
+			rio_writen(connfd, (char *)conn, strlen(conn)) < 0 ||
+			rio_writen(connfd, "\r\n", 2) < 0) return 0;
+
+	/* The published part of buf never changes, so it is written unlocked */
+	while(sent < f->contentLen) {
+		pthread_mutex_lock(&flightMutex);
+		while(f->state == FL_TAIL && f->len - f->bodyOff <= sent && flightWait(f));
+		avail = f->len - f->bodyOff - sent;
+		state = f->state;
+		pthread_mutex_unlock(&flightMutex);
+
+		if(avail == 0) return 0;	/* The leader failed */
+		if(rio_writen(connfd, f->buf + f->bodyOff + sent, avail) < 0) return 0;
+		sent += avail;
+		if(state == FL_FAILED && sent < f->contentLen) return 0;
+	}
+	return 1;
+}
@@ -0,0 +1,206 @@
+/*
+ * fresh.c - HTTP freshness of cached responses
+ *
+ * A response's freshness lifetime comes from Cache-Control (s-maxage,
+ * then max-age), then Expires less Date, and failing those from a tenth
+ * of the time since Last-Modified, capped at FRESH_HEURISTIC_MAX. A
+ * response with none of them is kept FRESH_DEFAULT seconds. The age it
+ * already had, from Date and Age, counts against the lifetime.
+ *
+ * Stale entries are revalidated with the ETag and Last-Modified they
+ * were stored with. For stale-while-revalidate seconds past its expiry,
+ * or staleWindow when the response does not say, an entry may still be
+ * served while it is refreshed (see refresh.c), unless the response
+ * demands revalidation.
+ */
+#include "proxy.h"
+
+#define FRESH_DEFAULT 300			/* Seconds */
+#define FRESH_HEURISTIC_MAX 86400
+
+int staleWindow = STALE_WINDOW;
+
+static const char *months = "JanFebMarAprMayJunJulAugSepOctNovDec";
+
+/* Parses an IMF-fixdate, "Sun, 06 Nov 1994 08:49:37 GMT", -1 if it is not one */
+time_t httpDate(char *s) {
+	struct tm tm;
+	char mon[4];
+	char *m;
+
+	memset(&tm, 0, sizeof(tm));
+	if(sscanf(s, "%*3s, %d %3s %d %d:%d:%d GMT", &tm.tm_mday, mon, &tm.tm_year, &tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 6)
+		return -1;
+	if((m = strstr(months, mon)) == NULL || strlen(mon) != 3 || (m - months) % 3 != 0) return -1;
+	tm.tm_mon = (m - months) / 3;
+	tm.tm_year -= 1900;
+	return timegm(&tm);
+}
+
+/* Value of a header line, past the colon and spaces */
+static char *hdrValue(char *line) {
+	char *v = strchr(line, ':') + 1;
+
+	while(*v == ' ' || *v == '\t') v++;
+	return v;
+}
+
+/* Seconds of a Cache-Control directive such as "max-age=60", -1 if absent */
+static long ccSeconds(char *value, const char *name) {
+	size_t n = strlen(name);
+	char *p;
+
+	for(p = value; *p; p++) {
+		if((p == value || p[-1] == ' ' || p[-1] == ',') && strncasecmp(p, name, n) == 0 && p[n] == '=')
+			return atol(p + n + 1);
+	}
+	return -1;
+}
+
+/*
+ * Reads the caching headers among the len bytes of header lines in hdr.
+ * 'now' stands in for a missing Date.
+ */
+void freshParse(char *hdr, size_t len, time_t now, freshInfo *fi) {
+	char line[MAXLINE], *p = hdr, *end = hdr + len, *eol, *v;
+	time_t expires = -1;
+	long maxAge = -1, sMaxAge = -1, swr = -1;
+	int hasExpires = 0, mustRevalidate = 0;
+	size_t n;
+
+	fi->store = 1;
+	fi->date = now;
+	fi->age = 0;
+	fi->lifetime = 0;
+	fi->explicit = 0;
+	fi->validators = 0;
+	fi->lastModified = -1;
+	fi->etagOff = 0;
+	fi->etagLen = 0;
+
+	while(p < end && (eol = memchr(p, '\n', end - p)) != NULL) {
+		n = eol + 1 - p;
+		if(n >= MAXLINE) break;
+		memcpy(line, p, n);
+		line[n] = '\0';
+		if(strchr(line, ':') == NULL) {
+			p = eol + 1;
+			continue;
+		}
+		v = hdrValue(line);
+
+		if(isHdr(line, "Cache-Control")) {
+			if(hdrHas(line, "no-store") || hdrHas(line, "private")) fi->store = 0;
+			if(hdrHas(line, "no-cache")) maxAge = 0;
+			else {
+				if(ccSeconds(v, "max-age") >= 0) maxAge = ccSeconds(v, "max-age");
+				if(ccSeconds(v, "s-maxage") >= 0) sMaxAge = ccSeconds(v, "s-maxage");
+			}
+			if(hdrHas(line, "no-cache") || hdrHas(line, "must-revalidate") || hdrHas(line, "proxy-revalidate"))
+				mustRevalidate = 1;
+			if(ccSeconds(v, "stale-while-revalidate") >= 0) swr = ccSeconds(v, "stale-while-revalidate");
+		}
+		else if(isHdr(line, "Date") && httpDate(v) >= 0) fi->date = httpDate(v);
+		else if(isHdr(line, "Age")) fi->age = atol(v);
+		else if(isHdr(line, "Expires")) {
+			expires = httpDate(v);	/* An invalid one means already expired */
+			hasExpires = 1;
+		}
+		else if(isHdr(line, "Last-Modified")) {
+			fi->lastModified = httpDate(v);
+			fi->validators = 1;
+		}
+		else if(isHdr(line, "ETag")) {
+			fi->etagOff = p - hdr + (v - line);
+			fi->etagLen = strcspn(v, "\r\n");
+			fi->validators = 1;
+		}
+		p = eol + 1;
+	}
+
+	/* An origin clock ahead of ours adds no life */
+	if(fi->date > now) fi->date = now;
+
+	if(sMaxAge >= 0 || maxAge >= 0) {
+		fi->lifetime = sMaxAge >= 0 ? sMaxAge : maxAge;
+		fi->explicit = 1;
+	}
+	else if(hasExpires) {
+		fi->lifetime = expires > fi->date ? expires - fi->date : 0;
+		fi->explicit = 1;
+	}
+	else if(fi->lastModified >= 0 && fi->lastModified < fi->date) {
+		fi->lifetime = (fi->date - fi->lastModified) / 10;
+		if(fi->lifetime > FRESH_HEURISTIC_MAX) fi->lifetime = FRESH_HEURISTIC_MAX;
+	}
+	else fi->lifetime = FRESH_DEFAULT;
+
+	if(mustRevalidate) fi->swr = 0;
+	else fi->swr = swr >= 0 ? swr : staleWindow;
+}
+
+/* When a response described by fi stops being fresh */
+time_t freshUntil(freshInfo *fi) {
+	return fi->date - fi->age + fi->lifetime;
+}
+
+/* Sets the lifetime in fi so that it expires at 'expires', worked out earlier */
+void freshExpire(freshInfo *fi, time_t expires) {
+	fi->lifetime = expires - fi->date + fi->age;
+}
+
+/*
+ * Whether the If-None-Match list inm names the entity tag etag, of len
+ * bytes. The comparison is weak: a "W/" prefix does not count.
+ */
+int freshMatch(char *inm, char *etag, size_t len) {
+	char *p = inm;
+	size_t n;
+
+	if(len >= 2 && strncmp(etag, "W/", 2) == 0) {
+		etag += 2;
+		len -= 2;
+	}
+	while(*p) {
+		p += strspn(p, " \t,");
+		if(*p == '*') return 1;
+		if(strncmp(p, "W/", 2) == 0) p += 2;
+		n = strcspn(p, " \t,");
+		if(n == len && strncmp(p, etag, len) == 0) return 1;
+		p += n;
+	}
+	return 0;
+}
+
+/*
+ * Writes the conditional request lines that revalidate the stored header
+ * lines in hdr to out, of size bytes, one for the first ETag and one for
+ * the first Last-Modified. Returns their length, 0 with out empty if hdr
+ * has no validator or the lines do not fit.
+ */
+size_t freshConditional(char *hdr, size_t len, char *out, size_t size) {
+	char line[MAXLINE], *p = hdr, *end = hdr + len, *eol;
+	size_t n, outLen = 0;
+	int etag = 0, lastMod = 0, w = 0;
+
+	out[0] = '\0';
+	while(p < end && (eol = memchr(p, '\n', end - p)) != NULL) {
+		n = eol + 1 - p;
+		if(n >= MAXLINE) break;
+		memcpy(line, p, n);
+		line[n] = '\0';
+		p = eol + 1;
+		if(strchr(line, ':') == NULL) continue;
+
+		if(isHdr(line, "ETag") && !etag++) w = snprintf(out + outLen, size - outLen, "If-None-Match: %s", hdrValue(line));
+		else if(isHdr(line, "Last-Modified") && !lastMod++) w = snprintf(out + outLen, size - outLen, "If-Modified-Since: %s", hdrValue(line));
+		else continue;
+
+		if(w < 0 || w >= size - outLen) {
+			out[0] = '\0';
+			return 0;
+		}
+		outLen += w;
+	}
+	return outLen;
+}
@@ -0,0 +1,172 @@
+/*
+ * pool.c - Idle upstream connections, pooled by host:port
+ *
+ * A finished response whose connection the origin keeps open goes back
+ * to its origin's idle list, at most POOL_PER_ORIGIN of them. The next
+ * miss for that origin takes the most recently used one and skips the
+ * connect. A pooled connection is dropped once it has idled for
+ * POOL_IDLE_TIMEOUT seconds, or when a zero-timeout poll finds it
+ * readable, which means the origin closed it or sent something unasked.
+ *
+ * The sweep unlinks origins left with no idle connection and keeps their
+ * structs for the next new origin. At most POOL_MAX_ORIGINS origins hold
+ * connections at once; past that a finished connection is just closed.
+ */
+#include "proxy.h"
+#include <poll.h>
+
+#define POOL_BUCKETS 256
+#define POOL_PER_ORIGIN 8		/* Idle connections kept per origin */
+#define POOL_IDLE_TIMEOUT 30	/* Seconds */
+#define POOL_MAX_ORIGINS 256
+
+typedef struct poolConn {
+	int fd;
+	time_t since;				/* Idle since */
+	struct poolConn *next;
+} poolConn;
+
+typedef struct origin {
+	char *key;					/* host:port */
+	poolConn *idle;				/* Most recently used first */
+	int idleCnt;
+	struct origin *next;
+} origin;
+
+static origin *pool[POOL_BUCKETS];
+static origin *freeOrigins;		/* Unlinked by the sweep, for reuse */
+static int originCnt;
+static sem_t poolMutex;
+static time_t lastSweep;
+
+void poolInit() {
+	Sem_init(&poolMutex, 0, 1);
+}
+
+/* Callers hold poolMutex */
+static origin *poolOrigin(char *key, int create) {
+	origin **b = &pool[cacheHash(key) % POOL_BUCKETS], *o;
+
+	for(o = *b; o != NULL; o = o->next) {
+		if(strcmp(o->key, key) == 0) return o;
+	}
+	if(!create || originCnt >= POOL_MAX_ORIGINS) return NULL;
+
+	if((o = freeOrigins) != NULL) freeOrigins = o->next;
+	else o = Malloc(sizeof(origin));
+	originCnt++;
+	o->key = Malloc(strlen(key) + 1);
+	strcpy(o->key, key);
+	o->idle = NULL;
+	o->idleCnt = 0;
+	o->next = *b;
+	*b = o;
+	return o;
+}
+
+/* Drops the connections of an origin that idled past the timeout */
+static void poolExpire(origin *o, time_t now) {
+	poolConn **p = &o->idle, *pc;
+
+	while((pc = *p) != NULL) {
+		if(now - pc->since >= POOL_IDLE_TIMEOUT) {
+			*p = pc->next;
+			close(pc->fd);
+			Free(pc);
+			o->idleCnt--;
+		}
+		else p = &pc->next;
+	}
+}
+
+/* At most once a second, so origins nobody asks for again let go too */
+static void poolSweep(time_t now) {
+	int i;
+	origin **p, *o;
+
+	if(now == lastSweep) return;
+	lastSweep = now;
+	for(i = 0; i < POOL_BUCKETS; i++) {
+		p = &pool[i];
+		while((o = *p) != NULL) {
+			poolExpire(o, now);
+			if(o->idleCnt > 0) {
+				p = &o->next;
+				continue;
+			}
+			*p = o->next;
+			Free(o->key);
+			o->next = freeOrigins;
+			freeOrigins = o;
+			originCnt--;
+		}
+	}
+}
+
+/* Whether an idle connection is still open and quiet */
+static int poolHealthy(int fd) {
+	struct pollfd pfd;
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	return poll(&pfd, 1, 0) == 0;
+}
+
+/* Returns a connection to host:port, pooled if one is healthy, sets *reused */
+int poolGet(char *host, char *port, int *reused) {
+	char key[MAXLINE];
+	origin *o;
+	poolConn *pc;
+	time_t now = time(NULL);
+	int fd;
+
+	snprintf(key, MAXLINE, "%s:%s", host, port);
+
+	P(&poolMutex);
+	poolSweep(now);
+	if((o = poolOrigin(key, 0)) != NULL) {
+		while((pc = o->idle) != NULL) {
+			o->idle = pc->next;
+			o->idleCnt--;
+			fd = pc->fd;
+			Free(pc);
+			if(poolHealthy(fd)) {
+				V(&poolMutex);
+				*reused = 1;
+				return fd;
+			}
+			close(fd);
+		}
+	}
+	V(&poolMutex);
+
+	*reused = 0;
+	return dnsConnect(host, port);
+}
+
+/* Keeps a connection that can carry another request, closing it if the origin has enough */
+void poolPut(char *host, char *port, int fd) {
+	char key[MAXLINE];
+	origin *o;
+	poolConn *pc;
+	time_t now = time(NULL);
+
+	snprintf(key, MAXLINE, "%s:%s", host, port);
+
+	P(&poolMutex);
+	poolSweep(now);
+	o = poolOrigin(key, 1);
+	if(o == NULL || o->idleCnt >= POOL_PER_ORIGIN) {
+		V(&poolMutex);
+		close(fd);
+		return;
+	}
+	pc = Malloc(sizeof(poolConn));
+	pc->fd = fd;
+	pc->since = now;
+	pc->next = o->idle;
+	o->idle = pc;
+	o->idleCnt++;
+	V(&poolMutex);
+}
@@ -1,153 +1,936 @@
 #include <stdio.h>
-#include "csapp.h"
+#include <sys/prctl.h>
+#include "proxy.h"
+#include "sbuf.h"
 
-/* Recommended max cache and object sizes */
-#define MAX_CACHE_SIZE 1049000
-#define MAX_OBJECT_SIZE 102400
-#define MAX_CACHE_NUMBER 10
-#define MAX_LRU 100
+/* Default disk tier budget, in megabytes */
+#define DISK_BUDGET 256
+
+/* Seconds between snapshots of the cache, besides the one on SIGTERM */
+#define SNAP_INTERVAL 300
+
+/* Default worker pool size and connection queue depth */
+#define NTHREADS 32
+#define SBUFSIZE 64
+
+/* Response bodies are relayed in blocks of this size */
+#define RELAY_BUFSIZE (64 * 1024)
+
+/* Persistent client connections */
+#define KEEPALIVE_TIMEOUT 15	/* Seconds a client may idle between requests */
+#define KEEPALIVE_MAX 100		/* Requests served on one connection */
 
 /* You won't lose style points for including this long line in your code */
 static const char *user_agent_hdr = "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n";
 static const char *host_hdr = "Host: %s\r\n";
 static const char *connection_hdr = "Connection: close\r\n";
 static const char *proxy_connection_hdr = "Proxy-Connection: close\r\n";
-static const char *request_hdr = "GET %s HTTP/1.0\r\n";
+static const char *keep_alive_hdr = "Connection: keep-alive\r\n";
 static const char *user_agent_macro = "User-Agent";
 static const char *host_macro = "Host";
 static const char *connection_macro = "Connection";
 static const char *proxy_connection_macro = "Proxy-Connection";
+static const char *keep_alive_macro = "Keep-Alive";
+
+/* Request headers not passed on by a fetch that fills the cache */
+static const char *client_only_hdrs[] = { "If-None-Match", "If-Modified-Since", "If-Match", "If-Unmodified-Since", "If-Range", "Range", NULL };
+
+/* Stored header lines a 304 carries */
+static const char *not_modified_hdrs[] = { "Cache-Control", "Content-Location", "Date", "ETag", "Expires", "Last-Modified", "Vary", NULL };
 
-void cacheInit();
 void doit(int connfd);
-int cacheFind(char *url);
-void parseURI(char *uri, char *hostName, char *path, int *port);
-void buildHttpHdr(char *httpHdr, char *hostName, char *path, int port, rio_t *clientRio);
-void beforeRead(int i);
-void afterRead(int i);
-void beforeWrite(int i);
-void afterWrite(int i);
-int cacheEvict();
-void cacheLRU(int index);
-void cacheURI(char *uri, char *buf);
-
-typedef struct {
-	char obj[MAX_OBJECT_SIZE];
-	char url[MAXLINE];
-	int LRU;
-	int isEmpty;
-	int rCnt;
-	sem_t rMutex;
-	sem_t wMutex; 
-} cacheBlock;
-
-typedef struct {
-	cacheBlock objs[MAX_CACHE_NUMBER]; 
-	int num;
-} cacheSet;
-
-cacheSet cache;
+int doRequest(int connfd, rio_t *clientRio, int last);
+int serveCached(int connfd, char *url, unsigned int hash, int keepAlive, condReq *cond, cacheEntry **stale);
+int serveHit(int connfd, cacheEntry *e, int keepAlive, condReq *cond);
+int relayResponse(int connfd, rio_t *rio, char *method, int http10, int keepAlive, flight *f, cacheEntry *stale, int *reusable);
+int relayBody(rio_t *rio, int fd, long len, int chunked, int dechunk, fill_t *fl);
+void revalidated(cacheEntry *e, char *hdr, size_t len);
+long dechunkBody(char *in, size_t len, char *out, size_t cap);
+int relayBytes(rio_t *rio, int fd, long len, fill_t *fl);
+int spliceBytes(rio_t *rio, int fd, long *len);
+void fillObj(fill_t *fl, char *buf, size_t n);
+void spoolResponse(char *url, fill_t *fl, long contentLen);
+void stripHdr(char *hdrs, const char *name);
+
+sbuf_t sbuf; /* Shared buffer of connected descriptors */
+int useSplice = 1; /* Relay uncacheable bodies with splice() */
+char *snapPath = NULL; /* Cache snapshot file, NULL if none */
+
+/* Shortest life of a worker process that is restarted at once */
+#define WORKER_MIN_LIFE 1
+
+/*
+ * Takes the signals the other threads block. SIGUSR1 prints cache,
+ * slab, resolver and disk statistics, SIGTERM saves the snapshot and exits.
+ * The snapshot is also saved every SNAP_INTERVAL seconds.
+ */
+void *signalThread(void *vargp) {
+	sigset_t *mask = vargp;
+	struct timespec interval = { SNAP_INTERVAL, 0 };
+	int sig;
+
+	Pthread_detach(pthread_self());
+	while(1) {
+		sig = snapPath ? sigtimedwait(mask, NULL, &interval) : sigwaitinfo(mask, NULL);
+		if(sig == SIGUSR1) {
+			cacheStats(stderr);
+			slabStats(stderr);
+			dnsStats(stderr);
+			diskStats(stderr);
+		}
+		else if(sig == SIGTERM) {
+			if(snapPath && snapSave(snapPath) < 0) fprintf(stderr, "snapshot error: %s\n", strerror(errno));
+			exit(0);
+		}
+		else if(sig < 0 && errno == EAGAIN) {
+			if(snapSave(snapPath) < 0) fprintf(stderr, "snapshot error: %s\n", strerror(errno));
+		}
+	}
+	return NULL;
+}
 
 void *thread(void *vargp) {
-	int connfd = (int)vargp;
+	int connfd;
+
 	Pthread_detach(pthread_self());
-	doit(connfd);
-	Close(connfd);
+	while(1) {
+		connfd = sbuf_remove(&sbuf);
+		doit(connfd);
+		Close(connfd);
+	}
+	return NULL;
+}
+
+/* Forks a worker, returns 0 in it */
+pid_t spawnWorker() {
+	pid_t pid;
+
+	if((pid = Fork()) == 0) {
+		prctl(PR_SET_PDEATHSIG, SIGTERM);
+		snapPath = NULL;	/* The supervisor saves snapshots */
+	}
+	return pid;
+}
+
+/*
+ * Runs procs worker processes on the listening socket, all sharing the
+ * cache, and restarts any that dies. Returns only in the workers. The
+ * supervisor stays here on the signals: SIGUSR1 goes on to the workers,
+ * SIGTERM stops them, saves the snapshot and exits. It also saves the
+ * snapshot every SNAP_INTERVAL seconds.
+ */
+void supervise(int procs, sigset_t *mask) {
+	struct timespec interval = { SNAP_INTERVAL, 0 };
+	pid_t *pids = Malloc(procs * sizeof(pid_t)), pid;
+	time_t *started = Malloc(procs * sizeof(time_t));
+	int i, sig, status;
+
+	for(i = 0; i < procs; i++) {
+		started[i] = time(NULL);
+		if((pids[i] = spawnWorker()) == 0) return;
+	}
+
+	while(1) {
+		sig = snapPath ? sigtimedwait(mask, NULL, &interval) : sigwaitinfo(mask, NULL);
+		if(sig == SIGCHLD) {
+			while((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+				for(i = 0; i < procs && pids[i] != pid; i++);
+				if(i == procs) continue;
+				if(WIFSIGNALED(status)) fprintf(stderr, "worker %d killed by signal %d, restarting\n", pid, WTERMSIG(status));
+				else fprintf(stderr, "worker %d exited with %d, restarting\n", pid, WEXITSTATUS(status));
+
+				/* Not in a tight loop if it dies on start */
+				if(time(NULL) - started[i] < WORKER_MIN_LIFE) sleep(WORKER_MIN_LIFE);
+				started[i] = time(NULL);
+				if((pids[i] = spawnWorker()) == 0) return;
+			}
+		}
+		else if(sig == SIGUSR1) {
+			for(i = 0; i < procs; i++) kill(pids[i], SIGUSR1);
+		}
+		else if(sig == SIGTERM) {
+			for(i = 0; i < procs; i++) kill(pids[i], SIGTERM);
+			for(i = 0; i < procs; i++) waitpid(pids[i], NULL, 0);
+			if(snapPath && snapSave(snapPath) < 0) fprintf(stderr, "snapshot error: %s\n", strerror(errno));
+			exit(0);
+		}
+		else if(sig < 0 && errno == EAGAIN) {
+			if(snapSave(snapPath) < 0) fprintf(stderr, "snapshot error: %s\n", strerror(errno));
+		}
+	}
+}
+
+void usage(char *prog) {
+	fprintf(stderr, "usage: %s [-p procs | -d dir [-D megabytes]] [-e loops | -t threads -q depth] [-S] [-s file] [-w secs] <port>\n", prog);
+	fprintf(stderr, "  -p procs    worker processes sharing one cache (default none, serve in this one)\n");
+	fprintf(stderr, "  -e loops    event-driven mode with <loops> epoll loop threads\n");
+	fprintf(stderr, "  -t threads  worker threads (default %d)\n", NTHREADS);
+	fprintf(stderr, "  -q depth    accepted connections waiting for a worker (default %d)\n", SBUFSIZE);
+	fprintf(stderr, "  -S          copy uncacheable bodies through user space instead of splice()\n");
+	fprintf(stderr, "  -d dir      keep a second cache tier on disk under <dir>, kept across restarts;\n");
+	fprintf(stderr, "              its index is per process, so not with -p\n");
+	fprintf(stderr, "  -D mbytes   disk tier budget (default %d)\n", DISK_BUDGET);
+	fprintf(stderr, "  -s file     load the cache from <file> at start, save it there on SIGTERM and every %d s\n", SNAP_INTERVAL);
+	fprintf(stderr, "  -w secs     serve entries up to <secs> stale while they are refreshed, unless\n");
+	fprintf(stderr, "              the response sets stale-while-revalidate or forbids it (default %d)\n", STALE_WINDOW);
+	exit(1);
 }
 
 int main(int argc, char **argv)
 {
-	int listenfd, connfd, clientlen;
+	int listenfd, connfd, opt;
+	int i, procCnt = 0, eventLoopCnt = 0, threadCnt = NTHREADS, queueDepth = SBUFSIZE, diskBudget = DISK_BUDGET;
+	char *diskDir = NULL;
+	socklen_t clientlen;
 	struct sockaddr_storage clientaddr;	
-	char hostName[MAXLINE], port[MAXLINE];
 	pthread_t tid;
+	static sigset_t sigMask;
+
+	while((opt = getopt(argc, argv, "p:e:t:q:Sd:D:s:w:")) != -1) {
+		switch(opt) {
+		case 'p':
+			if((procCnt = atoi(optarg)) <= 0) usage(argv[0]);
+			break;
+		case 'e':
+			if((eventLoopCnt = atoi(optarg)) <= 0) usage(argv[0]);
+			break;
+		case 't':
+			if((threadCnt = atoi(optarg)) <= 0) usage(argv[0]);
+			break;
+		case 'q':
+			if((queueDepth = atoi(optarg)) <= 0) usage(argv[0]);
+			break;
+		case 'S':
+			useSplice = 0;
+			break;
+		case 'd':
+			diskDir = optarg;
+			break;
+		case 'D':
+			if((diskBudget = atoi(optarg)) <= 0) usage(argv[0]);
+			break;
+		case 's':
+			snapPath = optarg;
+			break;
+		case 'w':
+			if((staleWindow = atoi(optarg)) < 0) usage(argv[0]);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if(optind != argc - 1) usage(argv[0]);
+
+	/* The disk index and budget are one process's, workers would fight over the files */
+	if(procCnt > 0 && diskDir != NULL) usage(argv[0]);
 	
-	cacheInit();
-	
+	/* Blocked before any thread starts, so all of them inherit it */
 	Signal(SIGPIPE, SIG_IGN);
+	Sigemptyset(&sigMask);
+	Sigaddset(&sigMask, SIGUSR1);
+	Sigaddset(&sigMask, SIGTERM);
+	if(procCnt > 0) Sigaddset(&sigMask, SIGCHLD);
+	Sigprocmask(SIG_BLOCK, &sigMask, NULL);
+
+	/* Shared with the workers, so made before they are forked */
+	cacheInit();
+	if(snapPath != NULL) snapLoad(snapPath);
+	listenfd = Open_listenfd(argv[optind]);
+	if(procCnt > 0) supervise(procCnt, &sigMask);
+
+	Pthread_create(&tid, NULL, signalThread, &sigMask);
+	if(diskDir != NULL) diskInit(diskDir, (size_t)diskBudget << 20);
+	poolInit();
+	if(eventLoopCnt == 0) refreshInit();
+
+	if(eventLoopCnt > 0) {
+		eventLoops(listenfd, eventLoopCnt);
+		return 0;
+	}
 	
-	listenfd = Open_listenfd(argv[1]);
+	sbuf_init(&sbuf, queueDepth);
+	for(i = 0; i < threadCnt; i++) Pthread_create(&tid, NULL, thread, NULL);
 	
+	/* A full queue blocks the accept loop, new clients wait in the listen backlog */
 	while(1) {
 		clientlen = sizeof(clientaddr);
 		connfd = Accept(listenfd, (SA *)&clientaddr, &clientlen);
-		Pthread_create(&tid, NULL, thread, (void *)connfd);
+		sbuf_insert(&sbuf, connfd);
 	}
 	
 	return 0;
 }
 
-void cacheInit() {
-	int i;
-	cache.num = 0;
-	
-	for(i = 0; i < MAX_CACHE_NUMBER; i++) {
-		cache.objs[i].LRU = 0;
-		cache.objs[i].isEmpty = 1;
-		cache.objs[i].rCnt = 0;
-		Sem_init(&cache.objs[i].rMutex, 0, 1);
-		Sem_init(&cache.objs[i].wMutex, 0, 1);
-	}
+/* Serves the requests of one client connection in order, pipelined ones included */
+void doit(int connfd) {
+	rio_t clientRio;
+	struct timeval tv;
+	int served = 0;
+
+	/* An idle client times out in rio_readlineb */
+	tv.tv_sec = KEEPALIVE_TIMEOUT;
+	tv.tv_usec = 0;
+	setsockopt(connfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+	rio_readinitb(&clientRio, connfd);
+	while(doRequest(connfd, &clientRio, ++served == KEEPALIVE_MAX));
 }
 
-void doit(int connfd) {
-	int endServerfd;
-	char buf[MAXLINE], function[MAXLINE], uri[MAXLINE], version[MAXLINE], endServerHttpHdr[MAXLINE], hostName[MAXLINE], path[MAXLINE], url[100], portStr[100];
-	int port;
-	int cacheIndex;
-	rio_t clientRio, endServerRio;
-
-	Rio_readinitb(&clientRio, connfd);
-	Rio_readlineb(&clientRio, buf, MAXLINE);
-	sscanf(buf, "%s %s %s", function, uri, version); 	
+/* Serves one request, returns 1 if the connection stays open for the next */
+int doRequest(int connfd, rio_t *clientRio, int last) {
+	int endServerfd, port, keepAlive, reqChunked = 0, reused, reusable, rc, tries, leader, i, reqOk;
+	char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE], endServerHttpHdr[REQUEST_HDR_SIZE], hostName[MAXLINE], path[MAXLINE], url[MAXLINE], portStr[100];
+	char hostHdr[MAXLINE], etcHdr[MAXLINE], condHdr[MAXLINE / 2];
+	cacheEntry *stale = NULL;
+	flight *f = NULL;
+	unsigned int hash;
+	long reqLen = 0;
+	rio_t endServerRio;
+	condReq cond;
+	char *v, *num;
+
+	/* Request line, skipping empty lines between requests */
+	do {
+		if(rio_readlineb(clientRio, buf, MAXLINE) <= 0) return 0;
+	} while(strcmp(buf, "\r\n") == 0 || strcmp(buf, "\n") == 0);
+	if(sscanf(buf, "%s %s %s", method, uri, version) != 3) return 0;
+
+	/* HTTP/1.1 keeps the connection unless told otherwise, HTTP/1.0 only when asked */
+	keepAlive = strcasecmp(version, "HTTP/1.1") == 0;
+
+	hostHdr[0] = '\0';
+	etcHdr[0] = '\0';
+	condInit(&cond, method);
+	while(1) {
+		if(rio_readlineb(clientRio, buf, MAXLINE) <= 0) return 0;
+		condParse(buf, &cond);
+		if(isHdr(buf, connection_macro) || isHdr(buf, proxy_connection_macro)) {
+			if(hdrHas(buf, "close")) keepAlive = 0;
+			else if(hdrHas(buf, "keep-alive")) keepAlive = 1;
+		}
+		else if(isHdr(buf, "Content-Length")) {
+			/* Anything but a plain count would mis-frame the body and what follows it */
+			num = strchr(buf, ':') + 1;
+			reqLen = strtol(num, &v, 10);
+			if(v == num || reqLen < 0 || v[strspn(v, " \t\r\n")] != '\0') {
+				clientError(connfd, "400 Bad Request");
+				return 0;
+			}
+		}
+		else if(isHdr(buf, "Transfer-Encoding") && hdrHas(buf, "chunked")) reqChunked = 1;
+		if((rc = filterHdr(buf, hostHdr, etcHdr)) < 0) {
+			clientError(connfd, "431 Request Header Fields Too Large");
+			return 0;
+		}
+		if(rc) break;
+	}
+	if(last) keepAlive = 0;
+
 	strcpy(url, uri);
+	hash = cacheHash(url);
 
-	cacheIndex = cacheFind(url);
+	/* A HEAD miss goes to the origin as it is, only a GET fills the cache */
+	if(cond.head && reqLen == 0 && !reqChunked) {
+		if((rc = serveCached(connfd, url, hash, keepAlive, &cond, NULL)) >= 0) return rc;
+	}
+	else if(strcasecmp(method, "GET") == 0 && reqLen == 0 && !reqChunked) {
+		if((rc = serveCached(connfd, url, hash, keepAlive, &cond, &stale)) >= 0) return rc;
+
+		/* Concurrent misses for a URL share one fetch */
+		f = flightJoin(url, hash, &leader);
+		if(!leader) {
+			if(stale != NULL) {
+				cacheRelease(stale);
+				stale = NULL;
+			}
+			rc = flightFollow(f, connfd, keepAlive ? keep_alive_hdr : connection_hdr);
+			flightRelease(f);
+			if(rc >= 0) return rc && keepAlive;
+
+			/* Not shareable as it streamed, the leader may have cached or revalidated it */
+			if((rc = serveCached(connfd, url, hash, keepAlive, &cond, NULL)) >= 0) return rc;
+			f = NULL;
+		}
 
-	if(cacheIndex != -1) {
-		beforeRead(cacheIndex);
-		Rio_writen(connfd, cache.objs[cacheIndex].obj, strlen(cache.objs[cacheIndex].obj));
-		afterRead(cacheIndex);
-		return;
+		/*
+		 * The leader fetches the whole response for the cache and the
+		 * followers, so the client's conditionals and Range stay here. A
+		 * stale copy is revalidated with its own validators instead.
+		 */
+		if(f != NULL) {
+			for(i = 0; client_only_hdrs[i] != NULL; i++) stripHdr(etcHdr, client_only_hdrs[i]);
+		}
+		if(stale != NULL) freshConditional(stale->obj, stale->hdrLen, condHdr, sizeof(condHdr));
+		if(stale != NULL && (condHdr[0] == '\0' || strlen(etcHdr) + strlen(condHdr) >= MAXLINE / 2)) {
+			cacheRelease(stale);
+			stale = NULL;
+		}
+		if(stale != NULL) {
+			strcat(etcHdr, condHdr);
+			__atomic_add_fetch(&cache->revalidations, 1, __ATOMIC_RELAXED);
+		}
 	}
 
 	parseURI(uri, hostName, path, &port);
-	buildHttpHdr(endServerHttpHdr, hostName, path, port, &clientRio);
 	sprintf(portStr, "%d", port);
-	endServerfd = Open_clientfd(hostName, portStr);
+	if(!(reqOk = finishHttpHdr(endServerHttpHdr, method, hostName, path, hostHdr, etcHdr, 1) == 0))
+		clientError(connfd, "431 Request Header Fields Too Large");
+
+	/*
+	 * The origin may close a pooled connection just as it is reused. If
+	 * nothing came back, a request without a body is tried once more on a
+	 * fresh connection.
+	 */
+	rc = 0;
+	for(tries = 0; reqOk; tries++) {
+		rc = -1;
+		if((endServerfd = poolGet(hostName, portStr, &reused)) < 0) break;
+
+		/* Request head, then its body if it has one */
+		reusable = 0;
+		if(rio_writen(endServerfd, endServerHttpHdr, strlen(endServerHttpHdr)) >= 0 &&
+				relayBody(clientRio, endServerfd, reqLen, reqChunked, 0, NULL) >= 0) {
+			rio_readinitb(&endServerRio, endServerfd);
+			rc = relayResponse(connfd, &endServerRio, method, strcasecmp(version, "HTTP/1.0") == 0, keepAlive, f, stale, &reusable);
+		}
 
-	if(endServerfd < 0) return;
+		if(reusable) poolPut(hostName, portStr, endServerfd);
+		else Close(endServerfd);
+		if(rc >= 0 || !reused || tries > 0 || reqLen > 0 || reqChunked) break;
+	}
+	if(rc == 2) rc = serveHit(connfd, stale, keepAlive, &cond) < 0 ? 0 : keepAlive;
 
-	Rio_readinitb(&endServerRio, endServerfd);
-	Rio_writen(endServerfd, endServerHttpHdr, strlen(endServerHttpHdr));
+	/* Fails the flight unless relayResponse finished it */
+	if(f != NULL) {
+		flightEnd(f, 0);
+		flightRelease(f);
+	}
+	if(stale != NULL) cacheRelease(stale);
+	return rc > 0;
+}
 
+/*
+ * Serves a fresh copy of url from memory, or else from the disk tier.
+ * Returns -1 if neither has one, otherwise 1 if the connection stays
+ * open. A copy in memory only just stale is served too while it is
+ * refreshed in the background. Any other stale copy is passed back in
+ * *stale, referenced, to be revalidated; with stale NULL it is let go.
+ */
+int serveCached(int connfd, char *url, unsigned int hash, int keepAlive, condReq *cond, cacheEntry **stale) {
+	cacheEntry *e;
+	int rc;
+
+	if((e = cacheFind(url, hash)) != NULL) {
+		if(!cacheFresh(e) && !refreshStale(e)) {
+			if(stale != NULL) *stale = e;
+			else cacheRelease(e);
+			return -1;
+		}
+		if(serveHit(connfd, e, keepAlive, cond) < 0) keepAlive = 0;
+		cacheRelease(e);
+		return keepAlive;
+	}
 
-	char objBuf[MAX_OBJECT_SIZE];
-	int bufSize = 0;
-	size_t s;
+	/* The disk tier only sends whole objects */
+	if(cond->head || cond->etag[0] != '\0' || cond->since >= 0) return -1;
+	if((rc = diskServe(url, connfd, keepAlive ? keep_alive_hdr : connection_hdr)) == 0) return -1;
+	return rc > 0 && keepAlive;
+}
 
-	while((s = Rio_readlineb(&endServerRio, buf, MAXLINE)) != 0) {
-		bufSize += s;
-		if(bufSize < MAX_OBJECT_SIZE) strcat(objBuf, buf);
-		Rio_writen(connfd, buf, s);
+/*
+ * Fetches the URL of a stale entry again for the cache alone, writing
+ * the response to fd, as a conditional request if the entry has
+ * validators. It leads a flight like any miss. Returns 1 if the entry
+ * was revalidated or replaced by a fresh one, or a fetch already under
+ * way will see to it.
+ */
+int refetch(int fd, cacheEntry *stale) {
+	int endServerfd, port, reused, reusable, rc, tries, leader, reqOk;
+	char url[MAXLINE], uri[MAXLINE], hostName[MAXLINE], path[MAXLINE], portStr[100], hostHdr[MAXLINE], etcHdr[MAXLINE / 2], httpHdr[REQUEST_HDR_SIZE];
+	cacheEntry *e;
+	flight *f;
+	rio_t endServerRio;
+
+	strcpy(url, stale->url);
+	f = flightJoin(url, stale->hash, &leader);
+	if(!leader) {
+		flightRelease(f);
+		return 1;
 	}
 
-	Close(endServerfd);
-	if(bufSize < MAX_OBJECT_SIZE) cacheURI(url, objBuf);
+	hostHdr[0] = '\0';
+	path[0] = '\0';
+	if(freshConditional(stale->obj, stale->hdrLen, etcHdr, MAXLINE / 2) > 0) __atomic_add_fetch(&cache->revalidations, 1, __ATOMIC_RELAXED);
+	strcpy(uri, url);
+	parseURI(uri, hostName, path, &port);
+	reqOk = finishHttpHdr(httpHdr, "GET", hostName, path, hostHdr, etcHdr, 1) == 0;
+	sprintf(portStr, "%d", port);
+
+	for(tries = 0; reqOk; tries++) {
+		rc = -1;
+		if((endServerfd = poolGet(hostName, portStr, &reused)) < 0) break;
+		reusable = 0;
+		if(rio_writen(endServerfd, httpHdr, strlen(httpHdr)) >= 0) {
+			rio_readinitb(&endServerRio, endServerfd);
+			rc = relayResponse(fd, &endServerRio, "GET", 0, 0, f, stale, &reusable);
+		}
+		if(reusable) poolPut(hostName, portStr, endServerfd);
+		else Close(endServerfd);
+		if(rc >= 0 || !reused || tries > 0) break;
+	}
+	flightEnd(f, 0);
+	flightRelease(f);
+
+	if(cacheFresh(stale)) return 1;
+	if((e = cacheFind(url, stale->hash)) == NULL) return 0;
+	rc = cacheFresh(e);
+	cacheRelease(e);
+	return rc;
+}
+
+/* Starts cond for a request of method, with no conditionals yet */
+void condInit(condReq *cond, char *method) {
+	cond->head = strcasecmp(method, "HEAD") == 0;
+	cond->etag[0] = '\0';
+	cond->since = -1;
 }
 
-int cacheFind(char *url) {
+/* Records the request header line buf in cond if it is a conditional */
+void condParse(char *buf, condReq *cond) {
+	char *v;
+
+	if(!isHdr(buf, "If-None-Match") && !isHdr(buf, "If-Modified-Since")) return;
+	v = strchr(buf, ':') + 1;
+	v += strspn(v, " \t");
+	if(isHdr(buf, "If-Modified-Since")) cond->since = httpDate(v);
+	else {
+		strcpy(cond->etag, v);
+		cond->etag[strcspn(cond->etag, "\r\n")] = '\0';
+	}
+}
+
+/*
+ * Writes to out, of e->hdrLen + MAXLINE bytes, the head of the reply to
+ * cond from e with the Connection line conn: a 304 if cond is a
+ * conditional it satisfies, the stored headers up to the empty line for
+ * a HEAD, and else the stored headers before e's empty line and body,
+ * which *body is set to tell. Returns the bytes written.
+ */
+size_t hitHdr(cacheEntry *e, const char *conn, condReq *cond, char *out, int *body) {
+	char *p, *eol, *end = e->obj + e->hdrLen;
+	size_t outLen;
 	int i;
-	
-	for(i = 0; i < MAX_CACHE_NUMBER; i++) {
-		beforeRead(i);
-		if((cache.objs[i].isEmpty == 0) && (strcmp(url, cache.objs[i].url) == 0)) break;
-		afterRead(i);
+
+	*body = 0;
+	if(notModified(e, cond)) {
+		__atomic_add_fetch(&cache->notModifiedHits, 1, __ATOMIC_RELAXED);
+		outLen = sprintf(out, "HTTP/1.1 304 Not Modified\r\n");
+		for(p = e->obj; p < end && (eol = memchr(p, '\n', end - p)) != NULL; p = eol + 1) {
+			for(i = 0; not_modified_hdrs[i] != NULL && !isHdr(p, not_modified_hdrs[i]); i++);
+			if(not_modified_hdrs[i] == NULL) continue;
+			memcpy(out + outLen, p, eol + 1 - p);
+			outLen += eol + 1 - p;
+		}
+		return outLen + sprintf(out + outLen, "%s\r\n", conn);
 	}
-	
-	if(i >= MAX_CACHE_NUMBER) return -1;
-	
-	return i;
+
+	memcpy(out, e->obj, e->hdrLen);
+	outLen = e->hdrLen + sprintf(out + e->hdrLen, "%s", conn);
+	if(cond->head) {
+		__atomic_add_fetch(&cache->headHits, 1, __ATOMIC_RELAXED);
+		return outLen + sprintf(out + outLen, "\r\n");
+	}
+	*body = 1;
+	return outLen;
+}
+
+/*
+ * Writes a cached response with this connection's Connection header,
+ * as a 304 if cond is a conditional it satisfies and without its body
+ * for a HEAD. Neither reads the body. Returns -1 on error.
+ */
+int serveHit(int connfd, cacheEntry *e, int keepAlive, condReq *cond) {
+	char *out;
+	size_t outLen;
+	int body, rc;
+
+	out = Malloc(e->hdrLen + MAXLINE);
+	outLen = hitHdr(e, keepAlive ? keep_alive_hdr : connection_hdr, cond, out, &body);
+	rc = rio_writen(connfd, out, outLen) < 0 ? -1 : 0;
+	Free(out);
+	if(rc == 0 && body && rio_writen(connfd, e->obj + e->hdrLen, e->size - e->hdrLen) < 0) rc = -1;
+	return rc;
+}
+
+/*
+ * Whether cond is answered 304 from the validators kept in e. If-None-Match
+ * decides when present, If-Modified-Since otherwise.
+ */
+int notModified(cacheEntry *e, condReq *cond) {
+	if(cond->etag[0] != '\0') return e->etagLen > 0 && freshMatch(cond->etag, e->obj + e->etagOff, e->etagLen);
+	return cond->since >= 0 && e->lastModified >= 0 && e->lastModified <= cond->since;
+}
+
+/*
+ * Relays one response without its hop-by-hop headers, filling the cache
+ * through the flight f if there is one. Chunked bodies are decoded for
+ * HTTP/1.0 clients. A 304 revalidating the stale entry is not relayed:
+ * the entry is made fresh and 2 returned, for the caller to serve it.
+ * Otherwise returns 1 if the client connection can carry another
+ * request, 0 if not, and -1 if the origin sent nothing. *reusable tells if the upstream connection can go back
+ * to the pool: only when the response ended where its framing says and
+ * nothing more was read. A malformed Content-Length leaves the body
+ * running to EOF, uncached.
+ */
+int relayResponse(int connfd, rio_t *rio, char *method, int http10, int keepAlive, flight *f, cacheEntry *stale, int *reusable) {
+	char buf[MAXLINE], relayBuf[RELAY_BUFSIZE], *num, *v;
+	const char *conn;
+	size_t hdrLen = 0;
+	ssize_t n;
+	long contentLen = -1;
+	int status = 0, chunked = 0, first = 1, upKeep = 0, flushed = 0, badLen = 0, rc;
+	fill_t fl;
+
+	*reusable = 0;
+	fl.obj = f ? f->buf : NULL;
+	fl.len = 0;
+	fl.cacheable = f != NULL;
+	fl.f = f;
+	fl.spool = NULL;
+
+	/* Headers line by line, written out together */
+	while(1) {
+		if((n = rio_readlineb(rio, buf, MAXLINE)) <= 0) return first ? -1 : 0;
+		fillObj(&fl, buf, n);
+		if(strcmp(buf, "\r\n") == 0 || strcmp(buf, "\n") == 0) break;
+
+		if(first) {
+			sscanf(buf, "%*s %d", &status);
+			upKeep = strncasecmp(buf, "HTTP/1.1", 8) == 0;
+		}
+		else if(isHdr(buf, "Content-Length")) {
+			num = strchr(buf, ':') + 1;
+			contentLen = strtol(num, &v, 10);
+			if(v == num || contentLen < 0 || v[strspn(v, " \t\r\n")] != '\0') {
+				badLen = 1;
+				continue;	/* Not relayed, the client reads to EOF too */
+			}
+		}
+		else if(isHdr(buf, "Transfer-Encoding") && hdrHas(buf, "chunked")) {
+			chunked = 1;
+			if(http10) continue;
+		}
+		else if(isHopHdr(buf)) {
+			if(isHdr(buf, connection_macro) && hdrHas(buf, "close")) upKeep = 0;
+			else if(isHdr(buf, connection_macro) && hdrHas(buf, "keep-alive")) upKeep = 1;
+			continue;
+		}
+		first = 0;
+
+		if(hdrLen + n > RELAY_BUFSIZE - MAXLINE) {
+			if(stale != NULL && status == 304) continue;	/* Never sent, only read for freshness */
+			if(rio_writen(connfd, relayBuf, hdrLen) < 0) return 0;
+			hdrLen = 0;
+			flushed = 1;
+		}
+		memcpy(relayBuf + hdrLen, buf, n);
+		hdrLen += n;
+	}
+
+	if(stale != NULL && status == 304) {
+		revalidated(stale, relayBuf, hdrLen);
+		*reusable = upKeep && !badLen && rio->rio_cnt == 0;
+		if(f != NULL) flightEnd(f, 1);
+		return 2;
+	}
+
+	/* Unframed : read to EOF, then the connection goes */
+	if(badLen) {
+		contentLen = -1;
+		fl.cacheable = 0;
+		upKeep = 0;
+	}
+
+	/* These have no body whatever their headers say */
+	if(strcasecmp(method, "HEAD") == 0 || status / 100 == 1 || status == 204 || status == 304) {
+		contentLen = 0;
+		chunked = 0;
+	}
+
+	/* Followers can tail a whole 200 body of known length that fits the fill */
+	if(f != NULL) {
+		if(status == 200 && !flushed && !chunked && contentLen >= 0 && fl.cacheable && fl.len + contentLen <= MAX_OBJECT_SIZE)
+			flightHead(f, relayBuf, hdrLen, contentLen);
+		else flightHead(f, NULL, 0, -1);
+	}
+
+	/* A body too big for memory may still fit the disk tier */
+	if(f != NULL && status == 200 && fl.cacheable && !chunked && contentLen > 0 && fl.len + contentLen > MAX_OBJECT_SIZE)
+		spoolResponse(f->url, &fl, contentLen);
+
+	/* A body running to EOF cannot be followed by another response */
+	if(!chunked && contentLen < 0) keepAlive = upKeep = 0;
+	if(chunked && http10) keepAlive = 0;
+	conn = keepAlive ? keep_alive_hdr : connection_hdr;
+	hdrLen += sprintf(relayBuf + hdrLen, "%s\r\n", conn);
+	if(rio_writen(connfd, relayBuf, hdrLen) < 0) return 0;
+
+	rc = relayBody(rio, connfd, contentLen, chunked, http10, &fl);
+	if(fl.spool != NULL) diskClose(fl.spool, rc == 0);
+	if(rc < 0) return 0;
+	*reusable = upKeep && rio->rio_cnt == 0;
+
+	/* Cached before the flight ends, so waiting followers find it */
+	if(fl.cacheable) cacheResponse(f->url, f->hash, fl.obj, fl.len);
+	if(f != NULL) flightEnd(f, 1);
+	return keepAlive;
+}
+
+/*
+ * Copies a body of len bytes, or chunked, or up to EOF when len is -1,
+ * filling the cache object if one is given. With dechunk only the chunk
+ * data is written. Returns -1 on error or a body cut short.
+ */
+int relayBody(rio_t *rio, int fd, long len, int chunked, int dechunk, fill_t *fl) {
+	char buf[MAXLINE];
+	ssize_t n;
+	long size;
+
+	if(!chunked) return relayBytes(rio, fd, len, fl);
+
+	/* Chunks as they come, each a size line then its data and CRLF */
+	while(1) {
+		if((n = rio_readlineb(rio, buf, MAXLINE)) <= 0) return -1;
+		fillObj(fl, buf, n);
+		if(!dechunk && rio_writen(fd, buf, n) < 0) return -1;
+		if((size = strtol(buf, NULL, 16)) <= 0) break;
+		if(relayBytes(rio, fd, size, fl) < 0) return -1;
+		if((n = rio_readlineb(rio, buf, MAXLINE)) <= 0) return -1;
+		fillObj(fl, buf, n);
+		if(!dechunk && rio_writen(fd, buf, n) < 0) return -1;
+	}
+
+	/* Trailers up to the empty line */
+	do {
+		if((n = rio_readlineb(rio, buf, MAXLINE)) <= 0) return -1;
+		fillObj(fl, buf, n);
+		if(!dechunk && rio_writen(fd, buf, n) < 0) return -1;
+	} while(strcmp(buf, "\r\n") != 0 && strcmp(buf, "\n") != 0);
+
+	return 0;
+}
+
+/*
+ * Copies len bytes in blocks, or up to EOF when len is -1. Once nothing
+ * is being cached, the rest goes through spliceBytes.
+ */
+int relayBytes(rio_t *rio, int fd, long len, fill_t *fl) {
+	char buf[RELAY_BUFSIZE];
+	size_t want;
+	ssize_t n;
+	int trySplice = useSplice, rc;
+
+	while(len != 0) {
+		if(trySplice && (fl == NULL || (!fl->cacheable && fl->spool == NULL))) {
+			if((rc = spliceBytes(rio, fd, &len)) != -2) return rc;
+			trySplice = 0;
+		}
+
+		want = RELAY_BUFSIZE;
+		if(len > 0 && len < want) want = len;
+		if((n = rio_readnb(rio, buf, want)) < 0) return -1;
+		if(n == 0) return len < 0 ? 0 : -1;
+		if(len > 0) len -= n;
+		fillObj(fl, buf, n);
+		if(rio_writen(fd, buf, n) < 0) return -1;
+	}
+	return 0;
+}
+
+/*
+ * Relays *len bytes, or up to EOF when it is -1, with spliceRelay after
+ * writing out whatever rio has already buffered. Returns -2 with *len
+ * left to copy when no pipe could be made.
+ */
+int spliceBytes(rio_t *rio, int fd, long *len) {
+	size_t want;
+
+	if(rio->rio_cnt > 0) {
+		want = rio->rio_cnt;
+		if(*len >= 0 && *len < want) want = *len;
+		if(rio_writen(fd, rio->rio_bufptr, want) < 0) return -1;
+		rio->rio_bufptr += want;
+		rio->rio_cnt -= want;
+		if(*len > 0) *len -= want;
+	}
+	if(*len == 0) return 0;
+
+	return spliceRelay(rio->rio_fd, fd, *len);
+}
+
+/* Appends to the cache fill, giving up once the object outgrows MAX_OBJECT_SIZE */
+void fillObj(fill_t *fl, char *buf, size_t n) {
+	if(fl == NULL) return;
+	if(fl->spool != NULL && diskWrite(fl->spool, buf, n) < 0) {
+		diskClose(fl->spool, 0);
+		fl->spool = NULL;
+	}
+	if(!fl->cacheable) return;
+	if(fl->len + n > MAX_OBJECT_SIZE) {
+		fl->cacheable = 0;
+		return;
+	}
+	memcpy(fl->obj + fl->len, buf, n);
+	fl->len += n;
+	if(fl->f != NULL) flightPublish(fl->f, fl->len);
+}
+
+/*
+ * Copies the header lines of a 200 response in obj to out, less the
+ * hop-by-hop ones, Content-Length and Transfer-Encoding. Returns their
+ * length, or -1 for another status or unfinished headers. *body is set
+ * past the empty line and *chunked to whether the body is chunked.
+ */
+long storeHdr(char *obj, size_t len, char *out, char **body, int *chunked) {
+	char line[MAXLINE];
+	char *p = obj, *end = obj + len, *eol;
+	size_t outLen = 0, n;
+	int status = 0;
+
+	*chunked = 0;
+	while((eol = memchr(p, '\n', end - p)) != NULL) {
+		n = eol + 1 - p;
+		if(n >= MAXLINE) return -1;
+		memcpy(line, p, n);
+		line[n] = '\0';
+		p = eol + 1;
+
+		if(strcmp(line, "\r\n") == 0 || strcmp(line, "\n") == 0) break;
+		if(outLen == 0) sscanf(line, "%*s %d", &status);
+		else if(isHdr(line, "Transfer-Encoding") && hdrHas(line, "chunked")) {
+			*chunked = 1;
+			continue;
+		}
+		else if(isHdr(line, "Content-Length") || isHopHdr(line)) continue;
+		memcpy(out + outLen, line, n);
+		outLen += n;
+	}
+	if(eol == NULL || status != 200) return -1;
+
+	*body = p;
+	return outLen;
+}
+
+/* Makes a stale entry fresh from the header lines of the 304 that revalidated it */
+void revalidated(cacheEntry *e, char *hdr, size_t len) {
+	freshInfo fi, stored;
+	time_t now = time(NULL);
+
+	/* The 304 may say nothing of freshness, the stored lifetime holds then */
+	freshParse(hdr, len, now, &fi);
+	if(!fi.explicit) {
+		freshParse(e->obj, e->hdrLen, now, &stored);
+		fi.lifetime = stored.lifetime;
+	}
+	cacheRefresh(e, freshUntil(&fi));
+	__atomic_add_fetch(&cache->notModified, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Caches a complete 200 response without its hop-by-hop headers. A
+ * chunked body is stored decoded, and it or a body that ran to EOF gets
+ * a Content-Length, so any client can be served and kept alive. One
+ * that outgrows memory that way goes to the disk tier instead.
+ */
+void cacheResponse(char *url, unsigned int hash, char *obj, size_t len) {
+	char out[MAX_OBJECT_SIZE + MAXLINE], body[MAX_OBJECT_SIZE];
+	char *p;
+	size_t outLen, hdrLen;
+	long bodyLen;
+	int chunked;
+
+	freshInfo fi;
+
+	/* Content-Length is rewritten below from the stored body */
+	if((bodyLen = storeHdr(obj, len, out, &p, &chunked)) < 0) return;
+	outLen = bodyLen;
+	freshParse(out, outLen, time(NULL), &fi);
+	if(!fi.store) return;
+
+	bodyLen = obj + len - p;
+	if(chunked) {
+		if((bodyLen = dechunkBody(p, bodyLen, body, MAX_OBJECT_SIZE)) < 0) return;
+		p = body;
+	}
+
+	outLen += sprintf(out + outLen, "Content-Length: %ld\r\n", bodyLen);
+	hdrLen = outLen;
+	memcpy(out + outLen, "\r\n", 2);
+	memcpy(out + outLen + 2, p, bodyLen);
+	outLen += 2 + bodyLen;
+
+	if(outLen > MAX_OBJECT_SIZE) diskPut(url, out, outLen, hdrLen, freshUntil(&fi));
+	else cacheURI(url, hash, out, outLen, hdrLen, &fi);
+}
+
+/*
+ * Starts writing a 200 response with contentLen body bytes still to come
+ * to the disk tier. The memory fill is given up: the body cannot fit.
+ */
+void spoolResponse(char *url, fill_t *fl, long contentLen) {
+	char *hdr = Malloc(fl->len + MAXLINE), *body;
+	long hdrLen;
+	int chunked;
+	freshInfo fi;
+
+	if((hdrLen = storeHdr(fl->obj, fl->len, hdr, &body, &chunked)) >= 0 &&
+			(freshParse(hdr, hdrLen, time(NULL), &fi), fi.store)) {
+		hdrLen += sprintf(hdr + hdrLen, "Content-Length: %ld\r\n", contentLen);
+		fl->spool = diskOpen(url, hdr, hdrLen, contentLen, freshUntil(&fi));
+	}
+	fl->cacheable = 0;
+	Free(hdr);
+}
+
+/* Decodes a complete chunked body, returns its length or -1 if malformed or over cap */
+long dechunkBody(char *in, size_t len, char *out, size_t cap) {
+	char *p = in, *end = in + len, *eol;
+	long size, outLen = 0;
+
+	while((eol = memchr(p, '\n', end - p)) != NULL) {
+		size = strtol(p, NULL, 16);
+		p = eol + 1;
+		if(size <= 0) return outLen;	/* Trailers are not kept */
+		if(size > end - p || outLen + size > cap) return -1;
+		memcpy(out + outLen, p, size);
+		outLen += size;
+		p += size;
+		if((eol = memchr(p, '\n', end - p)) == NULL) return -1;
+		p = eol + 1;
+	}
+	return -1;
+}
+
+/* Whether a header line is the header 'name' */
+int isHdr(char *line, const char *name) {
+	size_t len = strlen(name);
+
+	return strncasecmp(line, name, len) == 0 && line[len] == ':';
+}
+
+/* Whether a header line contains 'token', ignoring case */
+int hdrHas(char *line, const char *token) {
+	size_t len = strlen(token);
+
+	for(; *line; line++) {
+		if(strncasecmp(line, token, len) == 0) return 1;
+	}
+	return 0;
+}
+
+/* Headers that only apply to a single connection */
+int isHopHdr(char *line) {
+	return isHdr(line, connection_macro) || isHdr(line, proxy_connection_macro) || isHdr(line, keep_alive_macro);
 }
 
 void parseURI(char *uri, char *hostName, char *path, int *port) {
@@ -178,96 +961,60 @@ void parseURI(char *uri, char *hostName, char *path, int *port) {
 	}
 }
 
-void buildHttpHdr(char *httpHdr, char *hostName,char *path, int port, rio_t *clientRio) {
-	char buf[MAXLINE], hostHdr[MAXLINE], requestHdr[MAXLINE], etcHdr[MAXLINE];
-	
-	sprintf(requestHdr, request_hdr, path);
-	
-	while(Rio_readlineb(clientRio, buf, MAXLINE) > 0) {
-		if(strcmp(buf, "\r\n") == 0) break;
-		if(!strncasecmp(buf, host_macro, strlen(host_macro))) {
-			strcpy(hostHdr, buf);
-			continue;
-		}
-		if(!strncasecmp(buf, connection_macro, strlen(connection_macro)) && !strncasecmp(buf, proxy_connection_macro, strlen(proxy_connection_macro)) && !strncasecmp(buf, user_agent_macro, strlen(user_agent_macro))) {
-			strcat(etcHdr, buf);
-		}
+/*
+ * Sorts one client header line into hostHdr / etcHdr. Returns 1 at the
+ * end of the headers, and -1 if the line does not fit, rather than pass
+ * on a partial request.
+ */
+int filterHdr(char *buf, char *hostHdr, char *etcHdr) {
+	if(strcmp(buf, "\r\n") == 0) return 1;
+	if(!strncasecmp(buf, host_macro, strlen(host_macro))) {
+		strcpy(hostHdr, buf);
+		return 0;
 	}
-	if(strlen(hostHdr) == 0) {
-		sprintf(hostHdr, host_hdr, hostName);
+	/* Bodies go upstream at once, so Expect: 100-continue is not passed on */
+	if(!isHopHdr(buf) && !isHdr(buf, "Expect") && strncasecmp(buf, user_agent_macro, strlen(user_agent_macro))) {
+		if(strlen(etcHdr) + strlen(buf) >= MAXLINE / 2) return -1;
+		strcat(etcHdr, buf);
 	}
-
-	sprintf(httpHdr, "%s%s%s%s%s%s\r\n", requestHdr, hostHdr, connection_hdr, proxy_connection_hdr, user_agent_hdr, etcHdr);
-	
-	return ;
-}
-
-void beforeRead(int i) {
-	P(&cache.objs[i].rMutex);
-	(cache.objs[i].rCnt)++;
-	if(cache.objs[i].rCnt == 1)	P(&cache.objs[i].wMutex);
-	V(&cache.objs[i].rMutex);
+	return 0;
 }
 
-void afterRead(int i) {
-	P(&cache.objs[i].rMutex);
-	(cache.objs[i].rCnt)--;
-	if(cache.objs[i].rCnt == 0) V(&cache.objs[i].wMutex);
-	V(&cache.objs[i].rMutex);
-}
+/* Removes every header line called name from hdrs */
+void stripHdr(char *hdrs, const char *name) {
+	char *p = hdrs, *eol;
 
-void beforeWrite(int i) {
-	P(&cache.objs[i].wMutex);
+	while(*p) {
+		eol = strchr(p, '\n');
+		eol = eol != NULL ? eol + 1 : p + strlen(p);
+		if(isHdr(p, name)) memmove(p, eol, strlen(eol) + 1);
+		else p = eol;
+	}
 }
 
-void afterWrite(int i) {
-	V(&cache.objs[i].wMutex);
-}
+/*
+ * Builds the upstream request head in httpHdr, of REQUEST_HDR_SIZE bytes:
+ * HTTP/1.1 with keepAlive, so the connection can be pooled, HTTP/1.0 and
+ * close otherwise. hostHdr is a MAXLINE buffer. Returns -1 if the head
+ * does not fit.
+ */
+int finishHttpHdr(char *httpHdr, char *method, char *hostName, char *path, char *hostHdr, char *etcHdr, int keepAlive) {
+	int n;
 
-int cacheEvict() {
-	int evictIndex = 0;
-	int i;
-	
-	for(i = 0; i < MAX_CACHE_NUMBER; i++) {
-		beforeRead(i);
-		if(cache.objs[i].isEmpty == 1){
-			evictIndex = i;
-			afterRead(i);
-			break;
-		}		
-		if(cache.objs[i].LRU < MAX_LRU) { 
-			evictIndex = i;
-			afterRead(i);
-			continue;
-		}		
-		afterRead(i);
+	if(strlen(hostHdr) == 0) {
+		n = snprintf(hostHdr, MAXLINE, host_hdr, hostName);
+		if(n < 0 || n >= MAXLINE) return -1;
 	}
-	
-	return evictIndex;
-}
 
-void cacheLRU(int index) {
-	int i;
-	
-	for(i = 0; i < MAX_CACHE_NUMBER; i++) {
-		if(i == index) continue;
-		beforeWrite(i);
-		if(cache.objs[i].isEmpty == 0 && i != index) {
-			(cache.objs[i].LRU)--;
-		}
-		afterWrite(i);
-	}
+	if(keepAlive) n = snprintf(httpHdr, REQUEST_HDR_SIZE, "%s %s HTTP/1.1\r\n%s%s%s%s\r\n", method, path, hostHdr, keep_alive_hdr, user_agent_hdr, etcHdr);
+	else n = snprintf(httpHdr, REQUEST_HDR_SIZE, "%s %s HTTP/1.0\r\n%s%s%s%s%s\r\n", method, path, hostHdr, connection_hdr, proxy_connection_hdr, user_agent_hdr, etcHdr);
+	return n < 0 || n >= REQUEST_HDR_SIZE ? -1 : 0;
 }
 
-void cacheURI(char *uri, char *buf) {
-	int i = cacheEvict();
-	
-	beforeWrite(i);
-	strcpy(cache.objs[i].obj, buf);
-	strcpy(cache.objs[i].url, uri);
-	cache.objs[i].isEmpty = 0;
-	cache.objs[i].LRU = MAX_LRU;
-	cacheLRU(i);
-	afterWrite(i);
-}
+/* Refuses a request with an empty response, status being code and reason; the connection closes */
+void clientError(int fd, const char *status) {
+	char buf[MAXLINE];
 
+	sprintf(buf, "HTTP/1.1 %s\r\n%sContent-Length: 0\r\n\r\n", status, connection_hdr);
+	rio_writen(fd, buf, strlen(buf));
+}
@@ -0,0 +1,232 @@
+#ifndef __PROXY_H__
+#define __PROXY_H__
+
+#include "csapp.h"
+
+/* Upstream request head : the request line, Host, etcHdr and the proxy's own lines */
+#define REQUEST_HDR_SIZE (3 * MAXLINE)
+
+/* Recommended max cache and object sizes */
+#define MAX_CACHE_SIZE 1049000
+#define MAX_OBJECT_SIZE 102400
+
+/* Cache index : hash buckets */
+#define CACHE_BUCKETS (1 << 17)
+#define BUCKET(hash) ((hash) & (CACHE_BUCKETS - 1))
+
+/* Slab storage : pages and the most size classes they are cut into */
+#define SLAB_PAGE (1 << 17)
+#define SLAB_CLASSES 64
+
+/* Memory waiting for readers to leave (see epoch.c), linked from inside it */
+typedef struct epochNode {
+	void *p;
+	void (*fn)(void *);
+	unsigned long epoch;
+	struct epochNode *next;
+} epochNode;
+
+/* Snapshot entries, see snap.c */
+enum { SNAP_UNCHECKED = 1, SNAP_OK, SNAP_BAD };
+
+/* An entry, its URL and its object share one slab chunk, or live in the snapshot map */
+typedef struct cacheEntry {
+	char *url;
+	char *obj;
+	size_t size;				/* Response bytes */
+	size_t hdrLen;				/* Header lines before the empty line, hop-by-hop ones removed */
+	size_t alloc;				/* Bytes asked of the slab */
+	unsigned int hash;
+	struct cacheEntry *next;	/* Next entry in the bucket */
+	struct cacheEntry *lruPrev;	/* LRU list, NULL once evicted */
+	struct cacheEntry *lruNext;
+	unsigned long lruTick;		/* cache->inserts when last moved to the front */
+	int refs;					/* The cache's while indexed, and one per reader */
+	int mapped;					/* 0, or the SNAP_ state of a snapshot entry */
+	unsigned int sum;			/* Snapshot checksum, checked on first use */
+	time_t expires;				/* Fresh until then, moved on when revalidated */
+	int refreshing;				/* Queued for a background refresh */
+	time_t lastModified;		/* Validators, so conditionals never read obj : -1 if none */
+	unsigned int etagOff;		/* ETag value within obj */
+	unsigned int etagLen;		/* 0 if none */
+	epochNode retire;
+} cacheEntry;
+
+/* Shared by the worker processes, see shm.c */
+typedef struct {
+	cacheEntry *bucket[CACHE_BUCKETS];
+	cacheEntry lru;				/* LRU list head : lruNext is the most recent */
+	size_t bytes;				/* Slab chunk bytes held, counted against MAX_CACHE_SIZE */
+	int num;
+	unsigned long inserts;
+	int lruBroken;				/* A holder of lruMutex died, the list awaits a rebuild */
+	unsigned long repairs;
+	unsigned long revalidations;	/* Conditional requests for stale entries */
+	unsigned long notModified;		/* Of them, answered 304 */
+	unsigned long staleServed;		/* Hits served stale while refreshed */
+	unsigned long refreshed;		/* Background refreshes that made an entry fresh */
+	unsigned long refreshFailures;
+	unsigned long notModifiedHits;	/* Client conditionals answered 304 */
+	unsigned long headHits;
+	pthread_mutex_t lruMutex;
+	pthread_mutex_t insertMutex;
+} cacheSet;
+
+extern cacheSet *cache;
+
+/* A miss being fetched, shared with later misses for the same URL */
+enum { FL_HEAD, FL_TAIL, FL_WAIT, FL_DONE, FL_FAILED };
+
+typedef struct flight {
+	char *url;
+	unsigned int hash;
+	char *buf;					/* Raw response, MAX_OBJECT_SIZE bytes */
+	size_t len;					/* Bytes of buf published */
+	char *hdr;					/* Headers for followers, NULL unless tailing */
+	size_t hdrLen;
+	size_t bodyOff;				/* Body start in buf */
+	long contentLen;
+	int state;
+	int refs;
+	pthread_cond_t cond;
+	struct flight *next;
+} flight;
+
+/* A response being written to the disk tier, see disk.c */
+typedef struct diskFile diskFile;
+
+/* Caching headers of a response, see fresh.c */
+typedef struct {
+	int store;					/* 0 for no-store or private */
+	int explicit;				/* The lifetime came from Cache-Control or Expires */
+	int validators;				/* Has an ETag or Last-Modified */
+	long lifetime;				/* Seconds */
+	long swr;					/* Seconds it may be served stale while refreshed */
+	long age;
+	time_t date;
+	time_t lastModified;		/* -1 if none */
+	size_t etagOff;				/* ETag value within the headers */
+	size_t etagLen;				/* 0 if none */
+} freshInfo;
+
+/* Cache fill of a response being relayed */
+typedef struct {
+	char *obj;
+	size_t len;
+	int cacheable;
+	flight *f;					/* Published to as it fills, NULL if none */
+	diskFile *spool;			/* Body also written here, NULL if none */
+} fill_t;
+
+/* What a client asks of a cached response besides the whole of it */
+typedef struct {
+	int head;					/* Headers only */
+	char etag[MAXLINE];			/* If-None-Match list, empty if none */
+	time_t since;				/* If-Modified-Since, -1 if none */
+} condReq;
+
+/* cache.c */
+void cacheInit();
+unsigned int cacheHash(char *url);
+cacheEntry *cacheFind(char *url, unsigned int hash);
+void cacheRelease(cacheEntry *e);
+void cacheURI(char *uri, unsigned int hash, char *buf, size_t size, size_t hdrLen, freshInfo *fi);
+void cacheRefresh(cacheEntry *e, time_t expires);
+int cacheFresh(cacheEntry *e);
+int cacheAdopt(cacheEntry *e);
+void cacheStats(FILE *fp);
+void cacheFree(void *p);
+int lruLock();
+void lruUnlock();
+
+/* snap.c */
+int snapVerify(cacheEntry *e);
+void snapLoad(char *path);
+int snapSave(char *path);
+
+/* epoch.c */
+void epochInit();
+void epochEnter();
+void epochExit();
+void epochRetire(epochNode *n, void *p, void (*fn)(void *));
+void epochReclaim();
+
+/* fresh.c */
+#define STALE_WINDOW 10			/* Default seconds an entry may be served stale */
+extern int staleWindow;
+time_t httpDate(char *s);
+void freshParse(char *hdr, size_t len, time_t now, freshInfo *fi);
+time_t freshUntil(freshInfo *fi);
+void freshExpire(freshInfo *fi, time_t expires);
+int freshMatch(char *inm, char *etag, size_t len);
+size_t freshConditional(char *hdr, size_t len, char *out, size_t size);
+
+/* refresh.c */
+void refreshInit();
+int refreshStale(cacheEntry *e);
+
+/* shm.c */
+void *shmMap(size_t size, size_t align);
+void shmMutexInit(pthread_mutex_t *m);
+int shmLock(pthread_mutex_t *m);
+void shmUnlock(pthread_mutex_t *m);
+int shmDead(pid_t pid);
+
+/* slab.c */
+void slabInit();
+size_t slabChunkSize(size_t size);
+void *slabAlloc(size_t size);
+void slabFree(void *p, size_t size);
+void slabStats(FILE *fp);
+
+/* pool.c */
+void poolInit();
+int poolGet(char *host, char *port, int *reused);
+void poolPut(char *host, char *port, int fd);
+
+/* dns.c */
+int dnsLookup(char *host, char *port, struct addrinfo **res);
+void dnsFree(struct addrinfo *list);
+int dnsConnect(char *host, char *port);
+void dnsStats(FILE *fp);
+
+/* disk.c */
+void diskInit(char *dir, size_t budget);
+void diskPut(char *url, char *obj, size_t size, size_t hdrLen, time_t expires);
+diskFile *diskOpen(char *url, char *hdr, size_t hdrLen, long bodyLen, time_t expires);
+int diskWrite(diskFile *d, char *buf, size_t n);
+void diskClose(diskFile *d, int ok);
+int diskServe(char *url, int connfd, const char *conn);
+void diskStats(FILE *fp);
+
+/* splice.c */
+int spliceRelay(int in, int out, long len);
+
+/* flight.c */
+flight *flightJoin(char *url, unsigned int hash, int *leader);
+void flightHead(flight *f, char *hdr, size_t hdrLen, long contentLen);
+void flightPublish(flight *f, size_t len);
+void flightEnd(flight *f, int ok);
+void flightRelease(flight *f);
+int flightFollow(flight *f, int connfd, const char *conn);
+
+/* proxy.c */
+int refetch(int fd, cacheEntry *stale);
+void parseURI(char *uri, char *hostName, char *path, int *port);
+int filterHdr(char *buf, char *hostHdr, char *etcHdr);
+int finishHttpHdr(char *httpHdr, char *method, char *hostName, char *path, char *hostHdr, char *etcHdr, int keepAlive);
+void clientError(int fd, const char *status);
+void condInit(condReq *cond, char *method);
+void condParse(char *buf, condReq *cond);
+int notModified(cacheEntry *e, condReq *cond);
+size_t hitHdr(cacheEntry *e, const char *conn, condReq *cond, char *out, int *body);
+int isHdr(char *line, const char *name);
+int hdrHas(char *line, const char *token);
+int isHopHdr(char *line);
+long storeHdr(char *obj, size_t len, char *out, char **body, int *chunked);
+void cacheResponse(char *url, unsigned int hash, char *obj, size_t len);
+
+/* event.c */
+void eventLoops(int listenfd, int nloops);
+
+#endif /* __PROXY_H__ */
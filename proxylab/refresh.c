@@ -0,0 +1,86 @@
+/*
+ * refresh.c - Background refresh of stale cache entries
+ *
+ * An entry a little past its expiry, within the stale-while-revalidate
+ * window of its response (staleWindow seconds when it names none), is
+ * still served, and is queued for one of REFRESH_THREADS threads to
+ * revalidate or fetch again, so the client does not wait on the origin.
+ * The entry's refreshing flag queues it once across all the workers.
+ * When the queue is full the stale hit is fetched in the foreground as
+ * before, which keeps the refresh load bounded.
+ */
+#include "proxy.h"
+
+#define REFRESH_THREADS 4
+#define REFRESH_QUEUE 64
+
+static struct {
+	cacheEntry *queue[REFRESH_QUEUE];	/* Each holds a reference */
+	int head;
+	int cnt;
+	int nullfd;				/* Where the refreshed responses are written, -1 until started */
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+} rq = { .nullfd = -1, .mutex = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+
+static void refreshCount(unsigned long *c) {
+	__atomic_add_fetch(c, 1, __ATOMIC_RELAXED);
+}
+
+static void *refreshThread(void *vargp) {
+	cacheEntry *e;
+
+	Pthread_detach(pthread_self());
+	while(1) {
+		pthread_mutex_lock(&rq.mutex);
+		while(rq.cnt == 0) pthread_cond_wait(&rq.cond, &rq.mutex);
+		e = rq.queue[rq.head];
+		rq.head = (rq.head + 1) % REFRESH_QUEUE;
+		rq.cnt--;
+		pthread_mutex_unlock(&rq.mutex);
+
+		if(refetch(rq.nullfd, e)) refreshCount(&cache->refreshed);
+		else refreshCount(&cache->refreshFailures);
+		__atomic_store_n(&e->refreshing, 0, __ATOMIC_RELEASE);
+		cacheRelease(e);
+	}
+	return NULL;
+}
+
+/* Starts the refresh threads, in each worker process */
+void refreshInit() {
+	pthread_t tid;
+	int i;
+
+	rq.nullfd = Open("/dev/null", O_WRONLY, 0);
+	for(i = 0; i < REFRESH_THREADS; i++) Pthread_create(&tid, NULL, refreshThread, NULL);
+}
+
+/*
+ * Whether the stale entry e, which the caller holds, may be served as it
+ * is: it must be within its window and have a refresh queued or running.
+ */
+int refreshStale(cacheEntry *e) {
+	freshInfo fi;
+	time_t now = time(NULL);
+	int idle = 0;
+
+	if(rq.nullfd < 0) return 0;
+	freshParse(e->obj, e->hdrLen, now, &fi);
+	if(now >= __atomic_load_n(&e->expires, __ATOMIC_RELAXED) + fi.swr) return 0;
+
+	if(__atomic_compare_exchange_n(&e->refreshing, &idle, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+		pthread_mutex_lock(&rq.mutex);
+		if(rq.cnt == REFRESH_QUEUE) {
+			pthread_mutex_unlock(&rq.mutex);
+			__atomic_store_n(&e->refreshing, 0, __ATOMIC_RELEASE);
+			return 0;
+		}
+		__atomic_add_fetch(&e->refs, 1, __ATOMIC_RELAXED);
+		rq.queue[(rq.head + rq.cnt++) % REFRESH_QUEUE] = e;
+		pthread_cond_signal(&rq.cond);
+		pthread_mutex_unlock(&rq.mutex);
+	}
+	refreshCount(&cache->staleServed);
+	return 1;
+}
@@ -0,0 +1,61 @@
+/*
+ * shm.c - Memory shared by the worker processes
+ *
+ * The cache index, the slab pages and the epoch state live in anonymous
+ * MAP_SHARED mappings made before any worker is forked, so they sit at
+ * the same address in every process and pointers into them mean the
+ * same thing in all of them.
+ *
+ * Their locks are process-shared robust mutexes. A worker may die while
+ * holding one: the next locker is told, the mutex is made usable again,
+ * and the caller repairs whatever the dead holder may have left half
+ * changed.
+ */
+#include "proxy.h"
+#include <sys/mman.h>
+
+/* Maps 'size' zeroed shared bytes at an 'align' boundary, a power of two */
+void *shmMap(size_t size, size_t align) {
+	char *p, *aligned;
+
+	if(align < 4096) align = 4096;
+	p = mmap(NULL, size + align, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if(p == MAP_FAILED) unix_error("mmap error");
+
+	/* Trims the mapping down to the aligned part */
+	aligned = (char *)(((unsigned long)p + align - 1) & ~(unsigned long)(align - 1));
+	if(aligned > p) munmap(p, aligned - p);
+	munmap(aligned + size, p + align - aligned);
+	return aligned;
+}
+
+void shmMutexInit(pthread_mutex_t *m) {
+	pthread_mutexattr_t attr;
+
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+	if(pthread_mutex_init(m, &attr) != 0) app_error("pthread_mutex_init error");
+	pthread_mutexattr_destroy(&attr);
+}
+
+/* Returns 1 if the last holder died with the lock, and what it guards needs repair */
+int shmLock(pthread_mutex_t *m) {
+	int rc = pthread_mutex_lock(m);
+
+	if(rc == EOWNERDEAD) {
+		pthread_mutex_consistent(m);
+		return 1;
+	}
+	if(rc != 0) posix_error(rc, "pthread_mutex_lock error");
+	return 0;
+}
+
+void shmUnlock(pthread_mutex_t *m) {
+	pthread_mutex_unlock(m);
+}
+
+/* Whether a process that held shared state is gone */
+int shmDead(pid_t pid) {
+	return kill(pid, 0) < 0 && errno == ESRCH;
+}
@@ -0,0 +1,264 @@
+/*
+ * slab.c - Size-classed slab storage for cached objects
+ *
+ * Memory comes in SLAB_PAGE pages out of one shared arena of SLAB_PAGES
+ * pages (see shm.c), aligned so a chunk finds its page header by masking
+ * its address. Each page belongs to one size class and is cut into equal
+ * chunks. Classes start at SLAB_MIN and grow by SLAB_GROWTH up to the
+ * largest chunk a page can hold, so a chunk wastes less than a quarter
+ * of itself. Pages with free chunks sit on their class list, and a page
+ * whose chunks are all free goes back to the arena at once.
+ *
+ * Every change is made to one page at a time, which is noted as busy
+ * first. If a worker dies holding the lock, that page is set aside for
+ * good, its chunks still readable, and the class lists and the free page
+ * stack are rebuilt from the page states.
+ */
+#include "proxy.h"
+
+#define SLAB_MIN 64
+#define SLAB_GROWTH 1.25
+#define SLAB_ALIGN 8
+#define SLAB_PAGES 256			/* Arena size, in pages */
+
+/* Page states, zero is an arena page never or no longer used */
+enum { PAGE_FREE, PAGE_USED, PAGE_DEAD };
+
+typedef struct slabChunk {
+	struct slabChunk *next;
+} slabChunk;
+
+typedef struct slabPage {
+	int state;
+	int cls;
+	int used;						/* Chunks handed out */
+	slabChunk *free;
+	struct slabPage *prev;			/* Class list of pages with free chunks */
+	struct slabPage *next;
+} slabPage;
+
+typedef struct {
+	size_t size;					/* Chunk size */
+	int perPage;
+	slabPage *partial;
+	unsigned long pages;
+	unsigned long used;				/* Chunks in use */
+	size_t requested;				/* Bytes asked for by the chunks in use */
+} slabClass;
+
+typedef struct {
+	slabClass classes[SLAB_CLASSES];
+	int classCnt;
+	char *arena;
+	int fresh;						/* Arena pages ever handed out */
+	int freeCnt;
+	int freePages[SLAB_PAGES];		/* Stack of returned pages */
+	slabPage *busy;					/* Page being changed under the lock */
+	unsigned long deadPages;
+	pthread_mutex_t mutex;
+} slabState;
+
+#define PAGE_OF(p) ((slabPage *)((unsigned long)(p) & ~(unsigned long)(SLAB_PAGE - 1)))
+#define FIRST_CHUNK(pg) ((char *)(pg) + ((sizeof(slabPage) + SLAB_ALIGN - 1) & ~(SLAB_ALIGN - 1)))
+#define PAGE_AT(i) ((slabPage *)(slab->arena + (size_t)(i) * SLAB_PAGE))
+
+static slabState *slab;
+
+void slabInit() {
+	size_t size = SLAB_MIN, max = SLAB_PAGE - (FIRST_CHUNK((slabPage *)0) - (char *)0);
+	slabClass *classes;
+
+	slab = shmMap(sizeof(slabState), 64);
+	slab->arena = shmMap((size_t)SLAB_PAGES * SLAB_PAGE, SLAB_PAGE);
+	classes = slab->classes;
+	while(slab->classCnt < SLAB_CLASSES - 1 && size < max) {
+		classes[slab->classCnt].size = size;
+		classes[slab->classCnt].perPage = max / size;
+		slab->classCnt++;
+		size = ((size_t)(size * SLAB_GROWTH) + SLAB_ALIGN - 1) & ~(size_t)(SLAB_ALIGN - 1);
+	}
+	classes[slab->classCnt].size = max;
+	classes[slab->classCnt].perPage = 1;
+	slab->classCnt++;
+	shmMutexInit(&slab->mutex);
+}
+
+static int slabClassOf(size_t size) {
+	int lo = 0, hi = slab->classCnt - 1, mid;
+
+	while(lo < hi) {
+		mid = (lo + hi) / 2;
+		if(slab->classes[mid].size < size) lo = mid + 1;
+		else hi = mid;
+	}
+	return lo;
+}
+
+/* Chunk size that would hold 'size' bytes, 0 if no class can */
+size_t slabChunkSize(size_t size) {
+	if(size > slab->classes[slab->classCnt - 1].size) return 0;
+	return slab->classes[slabClassOf(size)].size;
+}
+
+static void slabListAdd(slabClass *sc, slabPage *pg) {
+	pg->prev = NULL;
+	pg->next = sc->partial;
+	if(sc->partial != NULL) sc->partial->prev = pg;
+	sc->partial = pg;
+}
+
+static void slabListDel(slabClass *sc, slabPage *pg) {
+	if(pg->prev != NULL) pg->prev->next = pg->next;
+	else sc->partial = pg->next;
+	if(pg->next != NULL) pg->next->prev = pg->prev;
+}
+
+/*
+ * After a holder died : sets its busy page aside, then rebuilds the
+ * class lists and the free page stack from what the pages say.
+ */
+static void slabRepair() {
+	slabPage *pg;
+	slabClass *sc;
+	int i;
+
+	if(slab->busy != NULL) {
+		slab->busy->state = PAGE_DEAD;
+		slab->busy = NULL;
+		slab->deadPages++;
+	}
+	for(i = 0; i < slab->classCnt; i++) {
+		slab->classes[i].partial = NULL;
+		slab->classes[i].pages = 0;
+		slab->classes[i].used = 0;
+	}
+	slab->freeCnt = 0;
+	for(i = 0; i < slab->fresh; i++) {
+		pg = PAGE_AT(i);
+		if(pg->state == PAGE_FREE) {
+			slab->freePages[slab->freeCnt++] = i;
+			continue;
+		}
+		if(pg->state != PAGE_USED) continue;
+		sc = &slab->classes[pg->cls];
+		sc->pages++;
+		sc->used += pg->used;
+		if(pg->used < sc->perPage) slabListAdd(sc, pg);
+	}
+}
+
+static void slabLock() {
+	if(shmLock(&slab->mutex)) slabRepair();
+}
+
+/* Takes an arena page and cuts it for class cls, NULL once the arena is used up */
+static slabPage *slabNewPage(int cls) {
+	slabPage *pg;
+	slabChunk *c;
+	int i;
+
+	if(slab->freeCnt > 0) pg = PAGE_AT(slab->freePages[--slab->freeCnt]);
+	else if(slab->fresh < SLAB_PAGES) pg = PAGE_AT(slab->fresh++);
+	else return NULL;
+
+	slab->busy = pg;
+	pg->cls = cls;
+	pg->used = 0;
+	pg->free = NULL;
+	for(i = slab->classes[cls].perPage - 1; i >= 0; i--) {
+		c = (slabChunk *)(FIRST_CHUNK(pg) + i * slab->classes[cls].size);
+		c->next = pg->free;
+		pg->free = c;
+	}
+	pg->prev = NULL;
+	pg->next = NULL;
+	pg->state = PAGE_USED;
+	slab->classes[cls].pages++;
+	return pg;
+}
+
+/* Returns a chunk of at least 'size' bytes, NULL if too large or out of memory */
+void *slabAlloc(size_t size) {
+	int cls;
+	slabClass *sc;
+	slabPage *pg;
+	slabChunk *c;
+
+	if(size > slab->classes[slab->classCnt - 1].size) return NULL;
+	cls = slabClassOf(size);
+	sc = &slab->classes[cls];
+
+	slabLock();
+	if((pg = sc->partial) == NULL) {
+		if((pg = slabNewPage(cls)) == NULL) {
+			shmUnlock(&slab->mutex);
+			return NULL;
+		}
+		slabListAdd(sc, pg);
+	}
+	slab->busy = pg;
+	c = pg->free;
+	pg->free = c->next;
+	if(++pg->used == sc->perPage) slabListDel(sc, pg);
+	sc->used++;
+	sc->requested += size;
+	slab->busy = NULL;
+	shmUnlock(&slab->mutex);
+
+	return c;
+}
+
+/* 'size' is the size given to slabAlloc */
+void slabFree(void *p, size_t size) {
+	slabPage *pg = PAGE_OF(p);
+	slabClass *sc = &slab->classes[pg->cls];
+	slabChunk *c = p;
+
+	slabLock();
+
+	/* A page set aside after a crash is never reused */
+	if(pg->state == PAGE_DEAD) {
+		shmUnlock(&slab->mutex);
+		return;
+	}
+
+	slab->busy = pg;
+	if(pg->used-- == sc->perPage) slabListAdd(sc, pg);
+	c->next = pg->free;
+	pg->free = c;
+	sc->used--;
+	sc->requested -= size;
+
+	if(pg->used == 0) {
+		slabListDel(sc, pg);
+		sc->pages--;
+		pg->state = PAGE_FREE;
+		slab->freePages[slab->freeCnt++] = ((char *)pg - slab->arena) / SLAB_PAGE;
+	}
+	slab->busy = NULL;
+	shmUnlock(&slab->mutex);
+}
+
+/* Per-class fill and waste : waste is page bytes not holding requested data */
+void slabStats(FILE *fp) {
+	int i;
+	slabClass *sc;
+	unsigned long total;
+	size_t mapped = 0, requested = 0;
+
+	slabLock();
+	fprintf(fp, "%6s %6s %8s %8s %6s %10s %10s\n", "size", "pages", "used", "chunks", "fill", "requested", "waste");
+	for(i = 0; i < slab->classCnt; i++) {
+		sc = &slab->classes[i];
+		if(sc->pages == 0) continue;
+		total = sc->pages * sc->perPage;
+		fprintf(fp, "%6zu %6lu %8lu %8lu %5.1f%% %10zu %10zu\n", sc->size, sc->pages, sc->used, total,
+				100.0 * sc->used / total, sc->requested, sc->pages * SLAB_PAGE - sc->requested);
+		mapped += sc->pages * SLAB_PAGE;
+		requested += sc->requested;
+	}
+	fprintf(fp, "total mapped %zu requested %zu waste %zu", mapped, requested, mapped - requested);
+	fprintf(fp, " arena %d/%d pages, %lu set aside\n", slab->fresh - slab->freeCnt, SLAB_PAGES, slab->deadPages);
+	shmUnlock(&slab->mutex);
+	fflush(fp);
+}
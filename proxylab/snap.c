@@ -0,0 +1,190 @@
+/*
+ * snap.c - Cache snapshot for warm restarts
+ *
+ * The memory cache is saved as one file: a snapHdr, an array of
+ * snapEntry, then every URL (with its NUL) and object back to back. At
+ * startup the file is mapped and only the index is read; the entries
+ * point into the mapping, so hits are served at once and the object
+ * pages are faulted in as they are used. Each entry's checksum is
+ * checked on its first hit instead of up front, and a bad entry is just
+ * never found again.
+ *
+ * A save takes a reference on every cached entry under the LRU lock,
+ * writes them least recently used first to a temporary file, and renames
+ * it over the old snapshot, which stays valid for anyone mapping it.
+ */
+#include "proxy.h"
+#include <sys/mman.h>
+
+#define SNAP_MAGIC 0x33505350	/* "PSP3" */
+
+typedef struct {
+	unsigned int magic;
+	unsigned int count;
+	unsigned long size;			/* Whole file */
+} snapHdr;
+
+typedef struct {
+	unsigned long urlOff;
+	unsigned long objOff;
+	unsigned long size;
+	unsigned long hdrLen;
+	long expires;
+	long lastModified;
+	unsigned int etagOff;
+	unsigned int etagLen;
+	unsigned int urlLen;
+	unsigned int sum;
+} snapEntry;
+
+/* FNV-1a over the URL and object */
+static unsigned int snapSum(char *url, char *obj, size_t size) {
+	unsigned int h = 2166136261u;
+	size_t i;
+
+	for(i = 0; url[i]; i++) {
+		h ^= (unsigned char)url[i];
+		h *= 16777619u;
+	}
+	for(i = 0; i < size; i++) {
+		h ^= (unsigned char)obj[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+/* Checks a mapped entry the first time it is used, 1 if it can be served */
+int snapVerify(cacheEntry *e) {
+	int state = __atomic_load_n(&e->mapped, __ATOMIC_RELAXED);
+
+	if(state == SNAP_UNCHECKED) {
+		state = snapSum(e->url, e->obj, e->size) == e->sum ? SNAP_OK : SNAP_BAD;
+		__atomic_store_n(&e->mapped, state, __ATOMIC_RELAXED);
+	}
+	return state != SNAP_BAD;
+}
+
+/* Maps the snapshot at path and indexes its entries, if there is a good one */
+void snapLoad(char *path) {
+	struct stat st;
+	snapHdr *h;
+	snapEntry *se;
+	cacheEntry *e;
+	char *map;
+	unsigned int i;
+	int fd;
+
+	if((fd = open(path, O_RDONLY)) < 0) return;
+	if(fstat(fd, &st) < 0 || st.st_size < sizeof(snapHdr)) {
+		close(fd);
+		return;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED) return;
+
+	h = (snapHdr *)map;
+	if(h->magic != SNAP_MAGIC || h->size != st.st_size ||
+			h->count > (st.st_size - sizeof(snapHdr)) / sizeof(snapEntry)) {
+		munmap(map, st.st_size);
+		return;
+	}
+
+	/* Only bounds are checked here, the contents on first use */
+	se = (snapEntry *)(h + 1);
+	for(i = 0; i < h->count; i++, se++) {
+		if(se->urlOff > st.st_size || se->urlLen >= st.st_size - se->urlOff || map[se->urlOff + se->urlLen] != '\0' ||
+				se->objOff > st.st_size || se->size > st.st_size - se->objOff || se->hdrLen > se->size ||
+				se->etagOff > se->hdrLen || se->etagLen > se->hdrLen - se->etagOff)
+			continue;
+
+		if((e = slabAlloc(sizeof(cacheEntry))) == NULL) break;
+		e->url = map + se->urlOff;
+		e->obj = map + se->objOff;
+		e->size = se->size;
+		e->hdrLen = se->hdrLen;
+		e->expires = se->expires;
+		e->refreshing = 0;
+		e->lastModified = se->lastModified;
+		e->etagOff = se->etagOff;
+		e->etagLen = se->etagLen;
+		e->alloc = sizeof(cacheEntry) + se->urlLen + 1 + se->size;
+		e->hash = cacheHash(e->url);
+		e->sum = se->sum;
+		e->mapped = SNAP_UNCHECKED;
+		if(!cacheAdopt(e)) cacheFree(e);
+	}
+
+	/* Stays mapped : entries point into it until evicted */
+}
+
+/* Writes the cache to path, replacing the snapshot there. -1 on error */
+int snapSave(char *path) {
+	char tmp[MAXLINE];
+	cacheEntry *e, **list;
+	snapHdr h;
+	snapEntry se;
+	unsigned long off;
+	int i, cnt = 0, fd, rc = 0;
+
+	/* Entries on the LRU list hold the cache's reference, so one more is safe */
+	if(!lruLock()) {
+		lruUnlock();
+		errno = EAGAIN;
+		return -1;
+	}
+	for(e = cache->lru.lruPrev; e != &cache->lru; e = e->lruPrev) cnt++;
+	list = Malloc((cnt + 1) * sizeof(cacheEntry *));
+	cnt = 0;
+	for(e = cache->lru.lruPrev; e != &cache->lru; e = e->lruPrev) {
+		__atomic_add_fetch(&e->refs, 1, __ATOMIC_RELAXED);
+		list[cnt++] = e;
+	}
+	lruUnlock();
+
+	/* A mapped entry is checked before its checksum is carried over */
+	for(i = 0; i < cnt; i++) {
+		if(list[i]->mapped && !snapVerify(list[i])) {
+			cacheRelease(list[i]);
+			list[i--] = list[--cnt];
+		}
+	}
+
+	sprintf(tmp, "%s.tmp", path);
+	if((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) rc = -1;
+
+	h.magic = SNAP_MAGIC;
+	h.count = cnt;
+	h.size = sizeof(h) + cnt * sizeof(snapEntry);
+	for(i = 0; i < cnt; i++) h.size += strlen(list[i]->url) + 1 + list[i]->size;
+	if(rc == 0 && rio_writen(fd, (char *)&h, sizeof(h)) < 0) rc = -1;
+
+	off = sizeof(h) + cnt * sizeof(snapEntry);
+	for(i = 0; rc == 0 && i < cnt; i++) {
+		e = list[i];
+		se.urlLen = strlen(e->url);
+		se.urlOff = off;
+		se.objOff = off + se.urlLen + 1;
+		se.size = e->size;
+		se.hdrLen = e->hdrLen;
+		se.expires = __atomic_load_n(&e->expires, __ATOMIC_RELAXED);
+		se.lastModified = e->lastModified;
+		se.etagOff = e->etagOff;
+		se.etagLen = e->etagLen;
+		se.sum = e->mapped ? e->sum : snapSum(e->url, e->obj, e->size);
+		off = se.objOff + e->size;
+		if(rio_writen(fd, (char *)&se, sizeof(se)) < 0) rc = -1;
+	}
+	for(i = 0; rc == 0 && i < cnt; i++) {
+		e = list[i];
+		if(rio_writen(fd, e->url, strlen(e->url) + 1) < 0 || rio_writen(fd, e->obj, e->size) < 0) rc = -1;
+	}
+
+	for(i = 0; i < cnt; i++) cacheRelease(list[i]);
+	Free(list);
+
+	if(fd >= 0 && close(fd) < 0) rc = -1;
+	if(rc == 0 && rename(tmp, path) < 0) rc = -1;
+	if(rc < 0) unlink(tmp);
+	return rc;
+}
@@ -0,0 +1,64 @@
+/*
+ * splice.c - Zero-copy relay between descriptors
+ *
+ * Kept apart from csapp.h, whose gai_error clashes with the glibc
+ * declaration that _GNU_SOURCE (needed for splice) brings in.
+ *
+ * Each thread keeps one pipe for all its relays, so a relay costs no
+ * pipe() and close() calls. A relay that fails may leave bytes in the
+ * pipe; it is closed then and the next relay makes a new one.
+ */
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+#define SPLICE_CHUNK (64 * 1024)	/* Bytes moved per splice() call */
+
+static __thread int myPipe[2] = { -1, -1 };
+
+/*
+ * Moves len bytes, or up to EOF when len is -1, from in to out through a
+ * pipe, so they never enter user space. Returns 0, or -1 on error or a
+ * body cut short, or -2 before moving anything if no pipe is available.
+ */
+int spliceRelay(int in, int out, long len) {
+	int *p = myPipe, rc = 0;
+	size_t want;
+	ssize_t n, m;
+
+	if(p[0] < 0 && pipe(p) < 0) return -2;
+
+	while(len != 0) {
+		want = SPLICE_CHUNK;
+		if(len > 0 && len < want) want = len;
+		if((n = splice(in, NULL, p[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_MORE)) < 0) {
+			if(errno == EINTR) continue;
+			rc = -1;
+			break;
+		}
+		if(n == 0) {
+			if(len > 0) rc = -1;
+			break;
+		}
+		if(len > 0) len -= n;
+
+		/* Drain the pipe into out */
+		while(n > 0) {
+			if((m = splice(p[0], NULL, out, NULL, n, SPLICE_F_MOVE | SPLICE_F_MORE)) <= 0) {
+				if(m < 0 && errno == EINTR) continue;
+				rc = -1;
+				break;
+			}
+			n -= m;
+		}
+		if(rc < 0) break;
+	}
+
+	if(rc < 0) {
+		close(p[0]);
+		close(p[1]);
+		p[0] = p[1] = -1;
+	}
+	return rc;
+}